@@ -7,7 +7,7 @@ set LINK=/errorReport:none /INCREMENTAL:NO
 
 echo.
 set APP_NAME=gust_pak
-cl.exe %APP_NAME%.c util.c parson.c /Fe%APP_NAME%.exe
+cl.exe %APP_NAME%.c pak.c manifest.c uring.c util.c /Fe%APP_NAME%.exe
 if %ERRORLEVEL% neq 0 goto out
 echo =^> %APP_NAME%.exe
 
@@ -17,320 +17,2808 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
+#include <time.h>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#endif
+
 #include "utf8.h"
 #include "util.h"
-#include "parson.h"
+#include "pak_internal.h"
+#include "thread.h"
+#include "manifest.h"
+#include "uring.h"
+
+static char* key_to_string(uint8_t* key)
+{
+    static char key_string[41];
+    for (size_t i = 0; i < 20; i++) {
+        key_string[2 * i] = ((key[i] >> 4) < 10) ? '0' + (key[i] >> 4) : 'a' + (key[i] >> 4) - 10;
+        key_string[2 * i + 1] = ((key[i] & 0xf) < 10) ? '0' + (key[i] & 0xf) : 'a' + (key[i] & 0xf) - 10;
+    }
+    key_string[40] = 0;
+    return key_string;
+}
+
+static uint8_t* string_to_key(const char* str)
+{
+    static uint8_t key[20];
+    for (size_t i = 0; i < 20; i++) {
+        key[i] = (str[2 * i] >= 'a') ? str[2 * i] - 'a' + 10 : str[2 * i] - '0';
+        key[i] <<= 4;
+        key[i] += (str[2 * i + 1] >= 'a') ? str[2 * i + 1] - 'a' + 10 : str[2 * i + 1] - '0';
+    }
+    return key;
+}
+
+static char* hash_to_string(uint64_t hash)
+{
+    static char hash_string[17];
+    snprintf(hash_string, sizeof(hash_string), "%016" PRIx64, hash);
+    return hash_string;
+}
+
+// Entries are streamed through a fixed size buffer, so that memory usage doesn't
+// depend on the size of the entries.
+#define CHUNK_SIZE          (1024 * 1024)
+
+static bool hash_file(const char* path, uint64_t* hash)
+{
+    xxh64_state state;
+    size_t len;
+    FILE* file = fopen_utf8(path, "rb");
+    uint8_t* buf = malloc(CHUNK_SIZE);
+    bool r = (file != NULL) && (buf != NULL);
+
+    if (r) {
+        xxh64_init(&state, 0);
+        while ((len = fread(buf, 1, CHUNK_SIZE, file)) != 0)
+            xxh64_update(&state, buf, len);
+        r = !ferror(file);
+        *hash = xxh64_digest(&state);
+    }
+    if (!r)
+        fprintf(stderr, "ERROR: Can't read from '%s'\n", path);
+    free(buf);
+    if (file != NULL)
+        fclose(file);
+    return r;
+}
+
+// Hash a file of size bytes that copy_range() just wrote or read. The file is
+// hashed through a mapping, from the OS cache, instead of being read back into
+// a buffer, so that the copy still saves the transfer of its data.
+static bool hash_copied_file(const char* path, uint32_t size, uint64_t* hash)
+{
+    mapped_file m;
+
+    if (!map_file(path, &m))
+        return false;
+    const bool r = (m.size == size);
+    if (r)
+        *hash = xxh64((m.data != NULL) ? m.data : (const uint8_t*)"", size, 0);
+    else
+        fprintf(stderr, "ERROR: Size of '%s' has changed\n", path);
+    unmap_file(&m);
+    return r;
+}
+
+// Compare the content of two files of the same size
+static bool is_same_file(const char* path1, const char* path2, uint32_t size)
+{
+    FILE* file1 = fopen_utf8(path1, "rb");
+    FILE* file2 = fopen_utf8(path2, "rb");
+    uint8_t* buf = malloc(2 * CHUNK_SIZE);
+    bool r = (file1 != NULL) && (file2 != NULL) && (buf != NULL);
+
+    for (uint32_t pos = 0, len; r && (pos < size); pos += len) {
+        len = min(size - pos, CHUNK_SIZE);
+        r = (fread(buf, 1, len, file1) == len) && (fread(&buf[CHUNK_SIZE], 1, len, file2) == len) &&
+            (memcmp(buf, &buf[CHUNK_SIZE], len) == 0);
+    }
+    free(buf);
+    if (file1 != NULL)
+        fclose(file1);
+    if (file2 != NULL)
+        fclose(file2);
+    return r;
+}
+
+// Look for an earlier entry with the same content and key as entry i, whose data
+// can therefore be shared, and add entry i to the table if there isn't any.
+// slots is an open addressing hash table of entry index + 1, keyed on content hash.
+// Entries with the same hash are compared byte by byte, so that a hash collision
+// can't make two different files share their data.
+static uint32_t find_duplicate(uint32_t* slots, uint32_t mask, pak_entry64* entries64, bool is_pak64,
+    const uint64_t* hashes, char** paths, uint32_t i)
+{
+    uint32_t h;
+    for (h = (uint32_t)hashes[i] & mask; slots[h] != 0; h = (h + 1) & mask) {
+        const uint32_t j = slots[h] - 1;
+        if ((hashes[j] == hashes[i]) && (entry(j, size) == entry(i, size)) &&
+            (memcmp(entry(j, key), entry(i, key), PAK_KEY_SIZE) == 0) &&
+            is_same_file(paths[j], paths[i], entry(i, size)))
+            return j;
+    }
+    slots[h] = i + 1;
+    return UINT32_MAX;
+}
+
+typedef struct {
+    uint64_t value;
+    uint32_t index;
+} sort_item;
+
+static int compare_sort_items(const void* a, const void* b)
+{
+    const sort_item* x = (const sort_item*)a;
+    const sort_item* y = (const sort_item*)b;
+    if (x->value != y->value)
+        return (x->value < y->value) ? -1 : 1;
+    return (x->index < y->index) ? -1 : ((x->index > y->index) ? 1 : 0);
+}
+
+// The table order need not match the data order, so we process the entries by
+// ascending offset, to keep I/O sequential. With multiple jobs, we process the
+// largest entries first instead, so that the jobs end up balanced.
+// Only the entries flagged in selected[] are scheduled, or all of them if NULL.
+static force_inline uint32_t fill_order(const bool is_pak64, pak_entry64* entries64, uint32_t nb_entries,
+    uint32_t nb_jobs, const bool* selected, sort_item* order)
+{
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < nb_entries; i++) {
+        if ((selected != NULL) && !selected[i])
+            continue;
+        order[n].index = i;
+        order[n++].value = (nb_jobs > 1) ? UINT32_MAX - entry(i, size) : entry(i, data_offset);
+    }
+    return n;
+}
+
+static sort_item* schedule_entries(pak_entry64* entries64, bool is_pak64, uint32_t nb_entries,
+    uint32_t nb_jobs, const bool* selected, uint32_t* nb_scheduled)
+{
+    sort_item* order = malloc(max(nb_entries, 1) * sizeof(sort_item));
+    if (order == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate entries\n");
+        return NULL;
+    }
+    const uint32_t n = pak_specialize(is_pak64, fill_order, entries64, nb_entries, nb_jobs, selected, order);
+    qsort(order, n, sizeof(sort_item), compare_sort_items);
+    *nb_scheduled = n;
+    return order;
+}
+
+// Create all the directories needed by the selected entries (all of them if selected
+// is NULL) before extraction, so that each directory is only created once.
+// The ancestors of every entry are sorted, which both removes duplicates and
+// ensures that parents are created before their children.
+typedef struct {
+    const char* name;
+    uint32_t len;
+} dir_item;
+
+static int compare_dir_items(const void* a, const void* b)
+{
+    const dir_item* x = (const dir_item*)a;
+    const dir_item* y = (const dir_item*)b;
+    int r = memcmp(x->name, y->name, min(x->len, y->len));
+    return (r != 0) ? r : (int)x->len - (int)y->len;
+}
+
+static bool create_directories(pak_entry64* entries64, bool is_pak64, uint32_t nb_entries, const bool* selected)
+{
+    bool r = false;
+    char path[256];
+    uint32_t nb_items = 0, max_items = 0;
+    dir_item* items = NULL;
+
+    for (uint32_t i = 0; i < nb_entries; i++) {
+        if ((selected != NULL) && !selected[i])
+            continue;
+        const char* name = &entry(i, filename)[1];
+        for (uint32_t n = 0; name[n] != 0; n++) {
+            if (name[n] != PATH_SEP)
+                continue;
+            if (nb_items >= max_items) {
+                max_items = max(2 * max_items, 1024);
+                dir_item* new_items = realloc(items, max_items * sizeof(dir_item));
+                if (new_items == NULL) {
+                    fprintf(stderr, "ERROR: Can't allocate directories\n");
+                    goto out;
+                }
+                items = new_items;
+            }
+            items[nb_items].name = name;
+            items[nb_items++].len = n;
+        }
+    }
+    qsort(items, nb_items, sizeof(dir_item), compare_dir_items);
+
+    for (uint32_t i = 0; i < nb_items; i++) {
+        if ((i > 0) && (compare_dir_items(&items[i - 1], &items[i]) == 0))
+            continue;
+        if (items[i].len >= sizeof(path)) {
+            fprintf(stderr, "ERROR: Path is too long\n");
+            goto out;
+        }
+        memcpy(path, items[i].name, items[i].len);
+        path[items[i].len] = 0;
+        // Only check for an existing directory if we failed to create one
+        if (!CREATE_DIR(path) && !is_directory(path)) {
+            fprintf(stderr, "ERROR: Can't create path '%s'\n", path);
+            goto out;
+        }
+    }
+    r = true;
+
+out:
+    free(items);
+    return r;
+}
+
+// State that belongs to a single worker
+typedef struct {
+    uint8_t* buf;
+    uint8_t* direct_buf;    // Aligned read and write buffers for direct I/O
+    uring* ring;            // Asynchronous writer for the extracted files, or NULL
+} worker_state;
+
+static uint8_t* get_chunk_buffer(worker_state* ws)
+{
+    if (ws->buf == NULL) {
+        ws->buf = malloc(CHUNK_SIZE);
+        if (ws->buf == NULL)
+            fprintf(stderr, "ERROR: Can't allocate buffer\n");
+    }
+    return ws->buf;
+}
+
+// Size of the direct I/O read buffer, which is followed by the write buffer
+#define DIRECT_READ_SIZE    (CHUNK_SIZE + 2 * DIRECT_ALIGNMENT)
+
+static uint8_t* get_direct_buffer(worker_state* ws)
+{
+    if (ws->direct_buf == NULL) {
+        ws->direct_buf = malloc_aligned(DIRECT_READ_SIZE + CHUNK_SIZE + DIRECT_ALIGNMENT);
+        if (ws->direct_buf == NULL)
+            fprintf(stderr, "ERROR: Can't allocate buffer\n");
+    }
+    return ws->direct_buf;
+}
+
+// Read size bytes from src, encode them with key and write them at offset in dst.
+// The hash of the unencoded data is returned in hash, if not NULL.
+static bool encode_file_at(FILE* src, const char* path, uint32_t size, const uint8_t* key,
+    FILE* dst, uint64_t offset, uint8_t* buf, uint64_t* hash)
+{
+    xxh64_state state;
+    const bool skip_encode = pak_is_zero_key(key);
+
+    xxh64_init(&state, 0);
+    for (uint32_t pos = 0, len; pos < size; pos += len) {
+        len = min(size - pos, CHUNK_SIZE);
+        if (fread(buf, 1, len, src) != len) {
+            fprintf(stderr, "ERROR: Can't read from '%s'\n", path);
+            return false;
+        }
+        xxh64_update(&state, buf, len);
+        if (!skip_encode)
+            pak_decode(buf, buf, key, len, pos);
+        if (!write_at(dst, buf, len, offset + pos)) {
+            fprintf(stderr, "ERROR: Can't write data for '%s'\n", path);
+            return false;
+        }
+    }
+    // The file must not have grown since we got its size
+    if (fgetc(src) != EOF) {
+        fprintf(stderr, "ERROR: Size of '%s' has changed\n", path);
+        return false;
+    }
+    if (hash != NULL)
+        *hash = xxh64_digest(&state);
+    return true;
+}
+
+// Journal of the entries that have been fully extracted, so that an interrupted
+// extraction can resume where it stopped. Records are appended as the entries
+// complete, and synced to disk at most every JOURNAL_SYNC_INTERVAL seconds, so
+// that the syncs cost little, while only the last few seconds of work have to be
+// done again after a crash.
+#define JOURNAL_MAGIC           "GUSTJRN3"
+#define JOURNAL_SYNC_INTERVAL   1
+
+typedef struct {
+    char magic[8];
+    uint64_t archive_size;
+    int64_t archive_mtime;
+    uint32_t nb_files;
+    uint32_t record_size;
+} journal_header;
+
+typedef struct {
+    uint32_t index;
+    uint32_t size;
+    uint64_t hash;
+    int64_t mtime;
+    int64_t time;           // When the record was written, after mtime was read
+    uint32_t check;         // Detects records that were only partly written
+} journal_record;
+
+typedef struct {
+    FILE* file;
+    char path[256];
+    time_t last_sync;
+    bool failed;
+    mutex_t lock;
+} journal;
+
+static uint32_t journal_check(const journal_record* rec)
+{
+    return (uint32_t)xxh64(rec, offsetof(journal_record, check), 0);
+}
+
+static bool journal_write(journal* j, uint32_t index, uint32_t size, uint64_t hash, int64_t mtime, int64_t now)
+{
+    journal_record rec = { 0 };
+    rec.index = index;
+    rec.size = size;
+    rec.hash = hash;
+    rec.mtime = mtime;
+    rec.time = now;
+    rec.check = journal_check(&rec);
+    return (fwrite(&rec, sizeof(rec), 1, j->file) == 1);
+}
+
+// Create the journal for the extraction of pak, after restoring the entries that the
+// journal from a previous extraction lists as written, if their files haven't changed
+// since. Restored entries are flagged in done[], and their count is returned in nb_done.
+// If the new journal can't be created, false is returned, but the restored entries
+// are still valid.
+// A file whose mtime isn't older than its record may have been modified in the same
+// second as it was recorded, so it is only restored if it still has the recorded hash.
+static bool journal_open(journal* j, const char* path, const char* pak_path, const pak_file* pak,
+    uint64_t* hashes, int64_t* mtimes, bool* done, uint32_t* nb_done)
+{
+    pak_entry64* entries64 = pak->entries64;
+    const bool is_pak64 = pak->is_pak64;
+    const uint32_t nb_files = pak->header.nb_files;
+    journal_header hdr, old_hdr;
+    journal_record rec;
+    struct stat64 st;
+    uint64_t hash;
+    int64_t* times = NULL;
+
+    *nb_done = 0;
+    strncpy(j->path, path, sizeof(j->path) - 1);
+    j->path[sizeof(j->path) - 1] = 0;
+    if (stat64_utf8(pak_path, &st) != 0) {
+        fprintf(stderr, "WARNING: Can't stat '%s'\n", pak_path);
+        return false;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+    hdr.archive_size = (uint64_t)st.st_size;
+    hdr.archive_mtime = (int64_t)st.st_mtime;
+    hdr.nb_files = nb_files;
+    hdr.record_size = sizeof(journal_record);
+
+    // A journal for another archive, or for another version of this one, is ignored.
+    // Reading stops at the first invalid record, which can only be a partial one.
+    FILE* file = fopen_utf8(j->path, "rb");
+    if (file != NULL) {
+        times = calloc(nb_files, sizeof(int64_t));
+        if ((times != NULL) && (fread(&old_hdr, sizeof(old_hdr), 1, file) == 1) && (memcmp(&old_hdr, &hdr, sizeof(hdr)) == 0)) {
+            while ((fread(&rec, sizeof(rec), 1, file) == 1) && (rec.check == journal_check(&rec)) &&
+                (rec.index < nb_files) && (rec.size == entry(rec.index, size))) {
+                if (done[rec.index] || (stat64_utf8(&entry(rec.index, filename)[1], &st) != 0) ||
+                    ((uint64_t)st.st_size != rec.size) || ((int64_t)st.st_mtime != rec.mtime))
+                    continue;
+                if ((rec.mtime >= rec.time) &&
+                    (!hash_file(&entry(rec.index, filename)[1], &hash) || (hash != rec.hash)))
+                    continue;
+                done[rec.index] = true;
+                hashes[rec.index] = rec.hash;
+                mtimes[rec.index] = rec.mtime;
+                times[rec.index] = rec.time;
+                (*nb_done)++;
+            }
+        }
+        fclose(file);
+    }
+
+    // Start the new journal with the entries that were restored
+    j->file = fopen_utf8(j->path, "wb");
+    if (j->file == NULL) {
+        fprintf(stderr, "WARNING: Can't create journal '%s'\n", j->path);
+        free(times);
+        return false;
+    }
+    bool r = (fwrite(&hdr, sizeof(hdr), 1, j->file) == 1);
+    for (uint32_t i = 0; r && (i < nb_files); i++) {
+        if (done[i])
+            r = journal_write(j, i, entry(i, size), hashes[i], mtimes[i], times[i]);
+    }
+    free(times);
+    if (!r || !sync_file(j->file)) {
+        fprintf(stderr, "WARNING: Can't write journal '%s'\n", j->path);
+        fclose(j->file);
+        j->file = NULL;
+        return false;
+    }
+    j->last_sync = time(NULL);
+    j->failed = false;
+    mutex_init(&j->lock);
+    return true;
+}
+
+// Record entry i as extracted. This can be called from multiple workers, and the
+// sync is done outside of the lock, so that the other workers don't wait for it.
+// Failing to write the journal only means that the entry can't be skipped on
+// resume, so it isn't an extraction error.
+static void journal_add(journal* j, uint32_t index, uint32_t size, uint64_t hash, int64_t mtime)
+{
+    bool sync = false, r = true;
+    const time_t now = time(NULL);
+
+    if (j == NULL)
+        return;
+    mutex_lock(&j->lock);
+    if (!j->failed) {
+        r = journal_write(j, index, size, hash, mtime, (int64_t)now);
+        if (now - j->last_sync >= JOURNAL_SYNC_INTERVAL) {
+            sync = r;
+            j->last_sync = now;
+        }
+    }
+    mutex_unlock(&j->lock);
+    if (sync)
+        r = sync_file(j->file);
+    if (!r) {
+        mutex_lock(&j->lock);
+        if (!j->failed)
+            fprintf(stderr, "WARNING: Can't write journal '%s'\n", j->path);
+        j->failed = true;
+        mutex_unlock(&j->lock);
+    }
+}
+
+// Close the journal, and delete it if the extraction has completed
+static void journal_close(journal* j, bool completed)
+{
+    if (j->file == NULL)
+        return;
+    fclose(j->file);
+    j->file = NULL;
+    mutex_destroy(&j->lock);
+    if (completed)
+        remove(j->path);
+}
+
+// State shared by all the workers that process the entries
+typedef struct pak_context pak_context;
+// Process the n-th entry from order[], using the state of the worker
+typedef bool (*process_fn)(pak_context* ctx, uint32_t n, worker_state* ws);
+struct pak_context {
+    // Archive being extracted or verified
+    const pak_file* pak;
+    FILE* file;
+    mapped_file* src;
+    pak_entry64* entries64;
+    bool is_pak64;
+    uint64_t file_data_offset;
+    char** paths;
+    uint64_t* hashes;
+    int64_t* mtimes;
+    // Absolute offset of the already encoded data in old_file, or UINT64_MAX
+    FILE* old_file;
+    uint64_t* reuse_offsets;
+    process_fn process;
+    bool use_uring;
+    // The archive, opened for direct I/O, if use_direct is set
+    bool use_direct;
+    direct_file direct;
+    // Where the extracted entries are recorded, or NULL
+    journal* journal;
+    sort_item* order;
+    uint32_t nb_entries;
+    uint32_t next;
+    bool failed;
+    mutex_t lock;
+};
+
+// Let the OS start fetching the entry that follows the n-th one while we process it
+static void prefetch_next_entry(pak_context* ctx, uint32_t n)
+{
+    pak_entry64* entries64 = ctx->entries64;
+    const bool is_pak64 = ctx->is_pak64;
+
+    if (n + 1 < ctx->nb_entries) {
+        const uint32_t next = ctx->order[n + 1].index;
+        advise_willneed(ctx->file, entry(next, data_offset) + ctx->file_data_offset, entry(next, size));
+    }
+}
+
+// Read and decode entry i in chunks, writing the decoded data to dst if not NULL,
+// and record its hash.
+static bool read_entry(pak_context* ctx, uint32_t i, uint8_t* buf, FILE* dst)
+{
+    pak_entry64* entries64 = ctx->entries64;
+    const bool is_pak64 = ctx->is_pak64;
+    xxh64_state state;
+
+    xxh64_init(&state, 0);
+    for (uint32_t pos = 0, len; pos < entry(i, size); pos += len) {
+        len = min(entry(i, size) - pos, CHUNK_SIZE);
+        if (!pak_read(ctx->pak, i, pos, len, buf)) {
+            fprintf(stderr, "ERROR: Can't read archive\n");
+            return false;
+        }
+        xxh64_update(&state, buf, len);
+        if ((dst != NULL) && (fwrite(buf, 1, len, dst) != len)) {
+            fprintf(stderr, "ERROR: Can't write file '%s'\n", &entry(i, filename)[1]);
+            return false;
+        }
+    }
+    ctx->hashes[i] = xxh64_digest(&state);
+    return true;
+}
+
+// Extract entry i without going through the OS cache, for either the archive or the file
+static bool extract_entry_direct(pak_context* ctx, uint32_t i, worker_state* ws)
+{
+    pak_entry64* entries64 = ctx->entries64;
+    const bool is_pak64 = ctx->is_pak64;
+    const char* path = &entry(i, filename)[1];
+    xxh64_state state;
+    bool r = false;
+
+    if (get_direct_buffer(ws) == NULL)
+        return false;
+    uint8_t* buf = &ws->direct_buf[DIRECT_READ_SIZE];
+    FILE* dst = fopen_utf8(path, "wb");
+    direct_file f = (dst == NULL) ? NO_DIRECT_FILE : open_direct(path, true);
+    if (f == NO_DIRECT_FILE) {
+        fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
+        goto out;
+    }
+    xxh64_init(&state, 0);
+    // The file positions of the chunks are aligned, so the write buffer is too
+    for (uint32_t pos = 0, len; pos < entry(i, size); pos += len) {
+        len = min(entry(i, size) - pos, CHUNK_SIZE);
+        const uint8_t* src = read_at_direct(ctx->direct, ws->direct_buf, len,
+            entry(i, data_offset) + ctx->file_data_offset + pos);
+        if (src == NULL) {
+            fprintf(stderr, "ERROR: Can't read archive\n");
+            goto out;
+        }
+        pak_decode(buf, src, entry(i, key), len, pos);
+        xxh64_update(&state, buf, len);
+        if (!write_at_direct(dst, f, buf, len, pos)) {
+            fprintf(stderr, "ERROR: Can't write file '%s'\n", path);
+            goto out;
+        }
+    }
+    ctx->hashes[i] = xxh64_digest(&state);
+    r = true;
+
+out:
+    close_direct(f);
+    if (dst != NULL)
+        fclose(dst);
+    return r;
+}
+
+static force_inline bool extract_entry(const bool is_pak64, pak_context* ctx, uint32_t n, worker_state* ws)
+{
+    pak_entry64* entries64 = ctx->entries64;
+    const uint32_t i = ctx->order[n].index;
+    struct stat64 st;
+
+    // Readahead would defeat the purpose of direct I/O
+    if (!ctx->use_direct)
+        prefetch_next_entry(ctx, n);
+    if (ctx->src != NULL) {
+        // Decode straight from the archive mapping into the output file mapping
+        const uint64_t offset = entry(i, data_offset) + ctx->file_data_offset;
+        mapped_file dst;
+        if (offset + entry(i, size) > ctx->src->size) {
+            fprintf(stderr, "ERROR: Can't read archive\n");
+            return false;
+        }
+        if (!create_mapped_file(&entry(i, filename)[1], entry(i, size), &dst))
+            return false;
+        const uint8_t* view = pak_view(ctx->pak, i);
+        if (view != NULL)
+            memcpy(dst.data, view, entry(i, size));
+        else
+            pak_decode(dst.data, &ctx->src->data[offset], entry(i, key), entry(i, size), 0);
+        ctx->hashes[i] = xxh64(dst.data, entry(i, size), 0);
+        unmap_file(&dst);
+        release_mapped_range(ctx->src, offset, entry(i, size));
+    } else if (ctx->use_direct) {
+        if (!extract_entry_direct(ctx, i, ws))
+            return false;
+    } else if (pak_is_zero_key(entry(i, key))) {
+        // Nothing to decode, so let the kernel copy the data without it going through
+        // user space, and hash the copy, which is still in the OS cache
+        const uint64_t offset = entry(i, data_offset) + ctx->file_data_offset;
+        FILE* dst = fopen_utf8(&entry(i, filename)[1], "wb");
+        if (dst == NULL) {
+            fprintf(stderr, "ERROR: Can't create file '%s'\n", &entry(i, filename)[1]);
+            return false;
+        }
+        bool r = copy_range(ctx->file, offset, dst, 0, entry(i, size));
+        fclose(dst);
+        if (!r) {
+            fprintf(stderr, "ERROR: Can't write file '%s'\n", &entry(i, filename)[1]);
+            return false;
+        }
+        if (!hash_copied_file(&entry(i, filename)[1], entry(i, size), &ctx->hashes[i]))
+            return false;
+    } else if ((ws->ring != NULL) && (entry(i, size) <= CHUNK_SIZE)) {
+        // Read the whole entry and hand it over to the ring, which creates, writes,
+        // closes and stats the file while we move on to the next entries
+        uint8_t* buf = malloc(max(entry(i, size), 1));
+        if (buf == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate buffer\n");
+            return false;
+        }
+        if (!pak_read(ctx->pak, i, 0, entry(i, size), buf)) {
+            fprintf(stderr, "ERROR: Can't read archive\n");
+            free(buf);
+            return false;
+        }
+        ctx->hashes[i] = xxh64(buf, entry(i, size), 0);
+        return uring_write_file(ws->ring, &entry(i, filename)[1], buf, entry(i, size), &ctx->mtimes[i]);
+    } else {
+        if (get_chunk_buffer(ws) == NULL)
+            return false;
+        FILE* dst = fopen_utf8(&entry(i, filename)[1], "wb");
+        if (dst == NULL) {
+            fprintf(stderr, "ERROR: Can't create file '%s'\n", &entry(i, filename)[1]);
+            return false;
+        }
+        bool r = read_entry(ctx, i, ws->buf, dst);
+        fclose(dst);
+        if (!r)
+            return false;
+    }
+
+    // Record the modification time, so that unmodified files can be detected on repack
+    if (stat64_utf8(&entry(i, filename)[1], &st) == 0)
+        ctx->mtimes[i] = (int64_t)st.st_mtime;
+    journal_add(ctx->journal, i, entry(i, size), ctx->hashes[i], ctx->mtimes[i]);
+    return true;
+}
+
+// The process_fn for each table layout
+static bool extract_entry32(pak_context* ctx, uint32_t n, worker_state* ws)
+{
+    return extract_entry(false, ctx, n, ws);
+}
+
+static bool extract_entry64(pak_context* ctx, uint32_t n, worker_state* ws)
+{
+    return extract_entry(true, ctx, n, ws);
+}
+
+static bool verify_entry(pak_context* ctx, uint32_t n, worker_state* ws)
+{
+    prefetch_next_entry(ctx, n);
+    if (get_chunk_buffer(ws) == NULL)
+        return false;
+    return read_entry(ctx, ctx->order[n].index, ws->buf, NULL);
+}
+
+// Encode the file for entry i into the archive, without going through the OS cache
+// for either of them, except for the partial blocks at both ends of the entry
+static bool pack_entry_direct(pak_context* ctx, uint32_t i, worker_state* ws)
+{
+    pak_entry64* entries64 = ctx->entries64;
+    const bool is_pak64 = ctx->is_pak64;
+    const uint64_t offset = entry(i, data_offset) + ctx->file_data_offset;
+    struct stat64 st;
+    xxh64_state state;
+
+    if (get_direct_buffer(ws) == NULL)
+        return false;
+    direct_file f = open_direct(ctx->paths[i], false);
+    if (f == NO_DIRECT_FILE) {
+        fprintf(stderr, "ERROR: Can't open '%s'\n", ctx->paths[i]);
+        return false;
+    }
+    // Place the encoded data so that it has the same alignment as its archive offset
+    uint8_t* buf = &ws->direct_buf[DIRECT_READ_SIZE];
+    bool r = true;
+    xxh64_init(&state, 0);
+    for (uint32_t pos = 0, len; r && (pos < entry(i, size)); pos += len) {
+        len = min(entry(i, size) - pos, CHUNK_SIZE);
+        uint8_t* dst = &buf[(offset + pos) % DIRECT_ALIGNMENT];
+        const uint8_t* src = read_at_direct(f, ws->direct_buf, len, pos);
+        if (src == NULL) {
+            fprintf(stderr, "ERROR: Can't read from '%s'\n", ctx->paths[i]);
+            r = false;
+            break;
+        }
+        xxh64_update(&state, src, len);
+        pak_decode(dst, src, entry(i, key), len, pos);
+        if (!write_at_direct(ctx->file, ctx->direct, dst, len, offset + pos)) {
+            fprintf(stderr, "ERROR: Can't write data for '%s'\n", ctx->paths[i]);
+            r = false;
+        }
+    }
+    close_direct(f);
+    // The file must not have grown since we got its size
+    if (r && ((stat64_utf8(ctx->paths[i], &st) != 0) || ((uint64_t)st.st_size != entry(i, size)))) {
+        fprintf(stderr, "ERROR: Size of '%s' has changed\n", ctx->paths[i]);
+        r = false;
+    }
+    if (r && (ctx->hashes != NULL))
+        ctx->hashes[i] = xxh64_digest(&state);
+    return r;
+}
+
+static force_inline bool pack_entry(const bool is_pak64, pak_context* ctx, uint32_t n, worker_state* ws)
+{
+    pak_entry64* entries64 = ctx->entries64;
+    const uint32_t i = ctx->order[n].index;
+    const uint64_t offset = entry(i, data_offset) + ctx->file_data_offset;
+
+    if ((ctx->reuse_offsets != NULL) && (ctx->reuse_offsets[i] != UINT64_MAX)) {
+        // Unmodified entry: copy the already encoded data from the previous archive
+        if (!copy_range(ctx->old_file, ctx->reuse_offsets[i], ctx->file, offset, entry(i, size))) {
+            fprintf(stderr, "ERROR: Can't copy data for '%s'\n", ctx->paths[i]);
+            return false;
+        }
+        return true;
+    }
+
+    if (ctx->use_direct)
+        return pack_entry_direct(ctx, i, ws);
+    FILE* src = fopen_utf8(ctx->paths[i], "rb");
+    if (src == NULL) {
+        fprintf(stderr, "ERROR: Can't open '%s'\n", ctx->paths[i]);
+        return false;
+    }
+    if (pak_is_zero_key(entry(i, key))) {
+        // Nothing to encode, so let the kernel copy the file into the archive, and
+        // hash it through a mapping, since the copy just cached it
+        bool r = copy_range(src, 0, ctx->file, offset, entry(i, size));
+        if (!r) {
+            fprintf(stderr, "ERROR: Can't copy data for '%s'\n", ctx->paths[i]);
+        } else if ((fseek64(src, 0, SEEK_END) != 0) || (ftell64(src) != (int64_t)entry(i, size))) {
+            // The file must not have grown since we got its size
+            fprintf(stderr, "ERROR: Size of '%s' has changed\n", ctx->paths[i]);
+            r = false;
+        } else if (ctx->hashes != NULL) {
+            r = hash_copied_file(ctx->paths[i], entry(i, size), &ctx->hashes[i]);
+        }
+        fclose(src);
+        return r;
+    }
+    if (get_chunk_buffer(ws) == NULL) {
+        fclose(src);
+        return false;
+    }
+    bool r = encode_file_at(src, ctx->paths[i], entry(i, size), entry(i, key), ctx->file, offset,
+        ws->buf, (ctx->hashes != NULL) ? &ctx->hashes[i] : NULL);
+    fclose(src);
+    return r;
+}
+
+static bool pack_entry32(pak_context* ctx, uint32_t n, worker_state* ws)
+{
+    return pack_entry(false, ctx, n, ws);
+}
+
+static bool pack_entry64(pak_context* ctx, uint32_t n, worker_state* ws)
+{
+    return pack_entry(true, ctx, n, ws);
+}
+
+static THREAD_CALL entry_worker(void* arg)
+{
+    pak_context* ctx = (pak_context*)arg;
+    worker_state ws = { 0 };
+    uint32_t n;
+
+    if (ctx->use_uring)
+        ws.ring = uring_create();
+    while (true) {
+        mutex_lock(&ctx->lock);
+        n = ctx->failed ? ctx->nb_entries : ctx->next++;
+        mutex_unlock(&ctx->lock);
+        if (n >= ctx->nb_entries)
+            break;
+        if (!ctx->process(ctx, n, &ws)) {
+            mutex_lock(&ctx->lock);
+            ctx->failed = true;
+            mutex_unlock(&ctx->lock);
+        }
+    }
+    if (!uring_destroy(ws.ring)) {
+        mutex_lock(&ctx->lock);
+        ctx->failed = true;
+        mutex_unlock(&ctx->lock);
+    }
+    free(ws.buf);
+    free_aligned(ws.direct_buf);
+    return 0;
+}
+
+// Run ctx->process() over all the entries, using nb_jobs workers
+static bool process_entries(pak_context* ctx, uint32_t nb_jobs)
+{
+    thread_t* threads = NULL;
+    uint32_t nb_threads = 0;
+
+    mutex_init(&ctx->lock);
+    if (nb_jobs > 1) {
+        threads = calloc(nb_jobs, sizeof(thread_t));
+        if (threads == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate threads\n");
+            ctx->failed = true;
+        }
+        // The main thread is one of the workers
+        for (; !ctx->failed && nb_threads < nb_jobs - 1; nb_threads++) {
+            if (!thread_create(&threads[nb_threads], entry_worker, ctx))
+                break;
+        }
+    }
+    entry_worker(ctx);
+    for (uint32_t i = 0; i < nb_threads; i++)
+        thread_join(threads[i]);
+    free(threads);
+    mutex_destroy(&ctx->lock);
+    return !ctx->failed;
+}
+
+// Number of chunks in flight between the stages of the extraction pipeline
+#define PIPELINE_SLOTS      4
+
+// A chunk of the data of the entries, as they follow each other in order[], on its way
+// from the archive to the extracted files. Small entries are grouped into a single
+// chunk, and large ones are split over multiple chunks.
+typedef struct {
+    uint8_t* buf;
+    uint32_t first;     // Index in order[] of the first entry
+    uint32_t pos;       // Position of the chunk in the first entry
+    uint32_t nb;        // Number of entries that the chunk covers, including partly
+    uint32_t len;
+} pipeline_slot;
+
+// Extraction with a reader thread, a decoder thread and the calling thread as the
+// writer, so that the I/O and the decoding of consecutive chunks overlap. A chunk
+// moves from one stage to the next as the read, decoded and written counters,
+// which only ever increase, go past it.
+typedef struct {
+    pak_context* ctx;
+    pipeline_slot slots[PIPELINE_SLOTS];
+    uint64_t nb_read;
+    uint64_t nb_decoded;
+    uint64_t nb_written;
+    bool read_done;
+    bool decode_done;
+    bool failed;
+    mutex_t lock;
+    cond_t cond;
+} pipeline;
+
+// Unencoded entries are copied by the writer, so they have no data in the chunks
+static uint32_t pipeline_size(const pak_context* ctx, uint32_t i)
+{
+    pak_entry64* entries64 = ctx->entries64;
+    const bool is_pak64 = ctx->is_pak64;
+    return pak_is_zero_key(entry(i, key)) ? 0 : entry(i, size);
+}
+
+// Wait until *count is above value, or the stage before has completed. Returns false
+// if there is nothing left to process, or if another stage failed.
+static bool pipeline_wait(pipeline* p, const uint64_t* count, uint64_t value, const bool* done)
+{
+    mutex_lock(&p->lock);
+    while (!p->failed && (*count <= value) && !*done)
+        cond_wait(&p->cond, &p->lock);
+    const bool r = !p->failed && (*count > value);
+    mutex_unlock(&p->lock);
+    return r;
+}
+
+// Move *count forward, or mark the stage as done if count is NULL, or fail the
+// whole pipeline, and wake up the other stages
+static void pipeline_advance(pipeline* p, uint64_t* count, bool* done, bool success)
+{
+    mutex_lock(&p->lock);
+    if (!success)
+        p->failed = true;
+    else if (count != NULL)
+        (*count)++;
+    else
+        *done = true;
+    cond_broadcast(&p->cond);
+    mutex_unlock(&p->lock);
+}
+
+static THREAD_CALL pipeline_reader(void* arg)
+{
+    pipeline* p = (pipeline*)arg;
+    pak_context* ctx = p->ctx;
+    pak_entry64* entries64 = ctx->entries64;
+    const bool is_pak64 = ctx->is_pak64;
+    const bool never = false;
+    uint32_t n = 0, pos = 0;
+    bool r = true;
+
+    while (r && (n < ctx->nb_entries)) {
+        // Wait for the writer to release a slot
+        if ((p->nb_read >= PIPELINE_SLOTS) && !pipeline_wait(p, &p->nb_written, p->nb_read - PIPELINE_SLOTS, &never))
+            break;
+        pipeline_slot* slot = &p->slots[p->nb_read % PIPELINE_SLOTS];
+        slot->first = n;
+        slot->pos = pos;
+        slot->nb = 0;
+        slot->len = 0;
+        // Fill the slot with as many entries, or as much of an entry, as it can hold
+        while (r && (n < ctx->nb_entries)) {
+            const uint32_t i = ctx->order[n].index;
+            const uint32_t size = pipeline_size(ctx, i);
+            const uint32_t len = min(size - pos, CHUNK_SIZE - slot->len);
+            if ((len == 0) && (pos < size))
+                break;
+            if ((len != 0) && !read_at(ctx->file, &slot->buf[slot->len], len,
+                entry(i, data_offset) + ctx->file_data_offset + pos)) {
+                fprintf(stderr, "ERROR: Can't read archive\n");
+                r = false;
+            }
+            slot->nb++;
+            slot->len += len;
+            pos += len;
+            if (pos < size)
+                break;
+            n++;
+            pos = 0;
+        }
+        pipeline_advance(p, &p->nb_read, NULL, r);
+    }
+    pipeline_advance(p, NULL, &p->read_done, r);
+    return 0;
+}
+
+static THREAD_CALL pipeline_decoder(void* arg)
+{
+    pipeline* p = (pipeline*)arg;
+    pak_context* ctx = p->ctx;
+    pak_entry64* entries64 = ctx->entries64;
+    const bool is_pak64 = ctx->is_pak64;
+    xxh64_state state;
+
+    while (pipeline_wait(p, &p->nb_read, p->nb_decoded, &p->read_done)) {
+        const pipeline_slot* slot = &p->slots[p->nb_decoded % PIPELINE_SLOTS];
+        for (uint32_t k = 0, done = 0; k < slot->nb; k++) {
+            const uint32_t i = ctx->order[slot->first + k].index;
+            const uint32_t size = pipeline_size(ctx, i);
+            const uint32_t start = (k == 0) ? slot->pos : 0;
+            const uint32_t len = min(size - start, slot->len - done);
+            if (pak_is_zero_key(entry(i, key)))
+                continue;
+            if (start == 0)
+                xxh64_init(&state, 0);
+            pak_decode(&slot->buf[done], &slot->buf[done], entry(i, key), len, start);
+            xxh64_update(&state, &slot->buf[done], len);
+            if (start + len == size)
+                ctx->hashes[i] = xxh64_digest(&state);
+            done += len;
+        }
+        pipeline_advance(p, &p->nb_decoded, NULL, true);
+    }
+    pipeline_advance(p, NULL, &p->decode_done, true);
+    return 0;
+}
+
+static bool pipeline_writer(pipeline* p)
+{
+    pak_context* ctx = p->ctx;
+    pak_entry64* entries64 = ctx->entries64;
+    const bool is_pak64 = ctx->is_pak64;
+    FILE* dst = NULL;
+    struct stat64 st;
+    bool r = true;
+
+    while (r && pipeline_wait(p, &p->nb_decoded, p->nb_written, &p->decode_done)) {
+        const pipeline_slot* slot = &p->slots[p->nb_written % PIPELINE_SLOTS];
+        for (uint32_t k = 0, done = 0; r && (k < slot->nb); k++) {
+            const uint32_t i = ctx->order[slot->first + k].index;
+            const uint32_t size = pipeline_size(ctx, i);
+            const uint32_t start = (k == 0) ? slot->pos : 0;
+            const uint32_t len = min(size - start, slot->len - done);
+            const char* path = &entry(i, filename)[1];
+            if (start == 0) {
+                dst = fopen_utf8(path, "wb");
+                if (dst == NULL) {
+                    fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
+                    r = false;
+                    break;
+                }
+            }
+            if (pak_is_zero_key(entry(i, key)))
+                r = copy_range(ctx->file, entry(i, data_offset) + ctx->file_data_offset, dst, 0, entry(i, size));
+            else
+                r = (fwrite(&slot->buf[done], 1, len, dst) == len);
+            done += len;
+            if (r && (start + len == size)) {
+                r = (fclose(dst) == 0);
+                dst = NULL;
+                if (r && pak_is_zero_key(entry(i, key)) && !hash_copied_file(path, entry(i, size), &ctx->hashes[i])) {
+                    r = false;
+                    break;
+                }
+                if (stat64_utf8(path, &st) == 0)
+                    ctx->mtimes[i] = (int64_t)st.st_mtime;
+                if (r)
+                    journal_add(ctx->journal, i, entry(i, size), ctx->hashes[i], ctx->mtimes[i]);
+            }
+            if (!r)
+                fprintf(stderr, "ERROR: Can't write file '%s'\n", path);
+        }
+        pipeline_advance(p, &p->nb_written, NULL, r);
+    }
+    if (dst != NULL)
+        fclose(dst);
+    return r && !p->failed;
+}
+
+// Extract all the entries from ctx with a single job, through the pipeline
+static bool pipeline_entries(pak_context* ctx)
+{
+    pipeline p = { 0 };
+    thread_t reader, decoder;
+    bool r = false;
+
+    p.ctx = ctx;
+    for (uint32_t i = 0; i < PIPELINE_SLOTS; i++) {
+        p.slots[i].buf = malloc(CHUNK_SIZE);
+        if (p.slots[i].buf == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate buffer\n");
+            goto out;
+        }
+    }
+    mutex_init(&p.lock);
+    cond_init(&p.cond);
+    if (!thread_create(&reader, pipeline_reader, &p)) {
+        r = process_entries(ctx, 1);
+    } else if (!thread_create(&decoder, pipeline_decoder, &p)) {
+        // Stop the reader, and fall back to extracting the entries one at a time
+        pipeline_advance(&p, NULL, NULL, false);
+        thread_join(reader);
+        r = process_entries(ctx, 1);
+    } else {
+        r = pipeline_writer(&p);
+        thread_join(reader);
+        thread_join(decoder);
+    }
+    cond_destroy(&p.cond);
+    mutex_destroy(&p.lock);
+
+out:
+    for (uint32_t i = 0; i < PIPELINE_SLOTS; i++)
+        free(p.slots[i].buf);
+    ctx->failed = !r;
+    return r;
+}
+
+// Replace the data of a single entry in an existing archive. The new data is written
+// over the old one if it fits, or appended at the end of the archive otherwise.
+static int replace_entry(const char* pak_path, const char* name, const char* path)
+{
+    int r = -1;
+    FILE* file = NULL, *src = NULL;
+    pak_header hdr;
+    pak_entry64* entries64 = NULL;
+    pak_entry64 raw_entry;
+    uint8_t* buf = NULL;
+    struct stat64 st;
+    bool is_pak64;
+    uint32_t i, size;
+
+    printf("Replacing '%s' in '%s'...\n", name, basename(pak_path));
+    file = fopen_utf8(pak_path, "rb+");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Can't open PAK file '%s'\n", pak_path);
+        goto out;
+    }
+    entries64 = pak_read_table(file, &hdr, &is_pak64);
+    if (entries64 == NULL)
+        goto out;
+    for (i = 0; (i < hdr.nb_files) && !pak_is_same_name(entry(i, filename), name); i++);
+    if (i >= hdr.nb_files) {
+        fprintf(stderr, "ERROR: Can't find '%s' in archive\n", name);
+        goto out;
+    }
+    if ((stat64_utf8(path, &st) != 0) || (st.st_size == 0) || (st.st_size > UINT32_MAX)) {
+        fprintf(stderr, "ERROR: Can't read from '%s'\n", path);
+        goto out;
+    }
+    size = (uint32_t)st.st_size;
+    src = fopen_utf8(path, "rb");
+    buf = malloc(CHUNK_SIZE);
+    if ((src == NULL) || (buf == NULL)) {
+        fprintf(stderr, "ERROR: Can't read from '%s'\n", path);
+        goto out;
+    }
+
+    const size_t entry_size = is_pak64 ? sizeof(pak_entry64) : sizeof(pak_entry32);
+    const uint64_t file_data_offset = sizeof(pak_header) + (uint64_t)hdr.nb_files * entry_size;
+    uint64_t data_offset = entry(i, data_offset);
+    bool in_place = (size <= entry(i, size));
+    // Deduplicated entries share their data, which must then be left alone
+    for (uint32_t j = 0; in_place && (j < hdr.nb_files); j++) {
+        if ((j != i) && (entry(j, data_offset) < data_offset + size) &&
+            (data_offset < entry(j, data_offset) + entry(j, size)))
+            in_place = false;
+    }
+    if (!in_place) {
+        fseek64(file, 0, SEEK_END);
+        data_offset = (uint64_t)ftell64(file) - file_data_offset;
+        if (!is_pak64 && (data_offset > UINT32_MAX)) {
+            fprintf(stderr, "ERROR: Archive is too large to append data to\n");
+            goto out;
+        }
+    }
+    if (!encode_file_at(src, path, size, entry(i, key), file, file_data_offset + data_offset, buf, NULL))
+        goto out;
+
+    // Only update the size and offset of the original table entry, as the
+    // in-memory one has its filename decoded
+    const uint64_t entry_offset = sizeof(pak_header) + (uint64_t)i * entry_size;
+    if (!read_at(file, &raw_entry, entry_size, entry_offset)) {
+        fprintf(stderr, "ERROR: Can't read PAK table\n");
+        goto out;
+    }
+    if (is_pak64) {
+        raw_entry.size = size;
+        raw_entry.data_offset = data_offset;
+    } else {
+        ((pak_entry32*)&raw_entry)->size = size;
+        ((pak_entry32*)&raw_entry)->data_offset = (uint32_t)data_offset;
+    }
+    if (!write_at(file, &raw_entry, entry_size, entry_offset)) {
+        fprintf(stderr, "ERROR: Can't write PAK table\n");
+        goto out;
+    }
+    printf("%09" PRIx64 " %08x %s%c (%s)\n", file_data_offset + data_offset, size, entry(i, filename),
+        pak_is_zero_key(entry(i, key)) ? '*' : ' ', in_place ? "in place" : "appended");
+    r = 0;
+
+out:
+    free(buf);
+    free(entries64);
+    if (src != NULL)
+        fclose(src);
+    if (file != NULL)
+        fclose(file);
+    return r;
+}
+
+// Write the .json that records everything needed to recreate an archive, one entry
+// at a time. If encoded is set, the names from the table must be decoded first.
+static bool write_manifest(const char* path, const char* name, const char* pak_path, const pak_header* hdr,
+    pak_entry64* entries64, bool is_pak64, bool encoded, const int64_t* mtimes, const uint64_t* hashes)
+{
+    manifest_writer w;
+    struct stat64 st;
+    char filename[129] = { 0 };
+
+    if (!manifest_create(&w, path))
+        return false;
+    manifest_begin_object(&w, NULL);
+    manifest_write_string(&w, "name", name);
+    manifest_write_number(&w, "version", hdr->version);
+    manifest_write_number(&w, "header_size", hdr->header_size);
+    manifest_write_number(&w, "flags", hdr->flags);
+    manifest_write_number(&w, "nb_files", hdr->nb_files);
+    manifest_write_boolean(&w, "64-bit", is_pak64);
+    if (stat64_utf8(pak_path, &st) == 0) {
+        manifest_write_number(&w, "archive_size", (uint64_t)st.st_size);
+        manifest_write_number(&w, "archive_mtime", (uint64_t)st.st_mtime);
+    }
+    // An entry whose mtime isn't older than this may have been modified in the same
+    // second as it was recorded, so its mtime alone doesn't prove it is unchanged
+    manifest_write_number(&w, "timestamp", (uint64_t)time(NULL));
+    manifest_begin_array(&w, "files");
+    for (uint32_t i = 0; i < hdr->nb_files; i++) {
+        memcpy(filename, entry(i, filename), sizeof(filename) - 1);
+        if (encoded && !pak_is_zero_key(entry(i, key)))
+            pak_decode((uint8_t*)filename, (uint8_t*)filename, entry(i, key), sizeof(filename) - 1, 0);
+        const uint64_t flags = is_pak64 ? getbe64(&entries64[i].flags) : getbe32(&entries32[i].flags);
+        manifest_begin_object(&w, NULL);
+        manifest_write_string(&w, "name", filename);
+        manifest_write_string(&w, "key", key_to_string(entry(i, key)));
+        if (flags != 0)
+            manifest_write_number(&w, "flags", flags);
+        manifest_write_number(&w, "size", entry(i, size));
+        manifest_write_number(&w, "mtime", (uint64_t)mtimes[i]);
+        manifest_write_string(&w, "hash", hash_to_string(hashes[i]));
+        manifest_end_object(&w);
+    }
+    manifest_end_array(&w);
+    manifest_end_object(&w);
+    if (!manifest_finish(&w)) {
+        fprintf(stderr, "ERROR: Can't write '%s'\n", path);
+        return false;
+    }
+    return true;
+}
+
+// Check the decoded data of all the entries of an archive against the hashes
+// recorded in the .json that was created when it was extracted.
+static int verify_archive(const char* pak_path, uint32_t nb_jobs)
+{
+    int r = -1;
+    pak_file* pak = NULL;
+    manifest_reader reader = { 0 };
+    manifest_header mh;
+    manifest_entry me;
+    pak_context ctx = { 0 };
+    uint64_t* expected = NULL;
+    bool* has_hash = NULL;
+    uint32_t nb_verified = 0, nb_mismatches = 0;
+    char json_path[256];
+
+    strncpy(json_path, change_extension(pak_path, ".json"), sizeof(json_path) - 1);
+    json_path[sizeof(json_path) - 1] = 0;
+    printf("Verifying '%s' against '%s'...\n", basename(pak_path), json_path);
+    pak = pak_open(pak_path, 0);
+    if (pak == NULL)
+        goto out;
+    pak_entry64* entries64 = pak->entries64;
+    const bool is_pak64 = pak->is_pak64;
+    const pak_header* hdr = &pak->header;
+    if (!manifest_open(&reader, json_path, &mh))
+        goto out;
+    expected = calloc(hdr->nb_files, sizeof(uint64_t));
+    has_hash = calloc(hdr->nb_files, sizeof(bool));
+    ctx.hashes = calloc(hdr->nb_files, sizeof(uint64_t));
+    if ((expected == NULL) || (has_hash == NULL) || (ctx.hashes == NULL)) {
+        fprintf(stderr, "ERROR: Can't allocate entries\n");
+        goto out;
+    }
+    for (uint32_t i = 0; i <= hdr->nb_files; i++) {
+        int n = manifest_read_entry(&reader, &me);
+        if (n < 0)
+            goto out;
+        if ((n == 0) != (i == hdr->nb_files)) {
+            fprintf(stderr, "ERROR: Number of entries doesn't match\n");
+            goto out;
+        }
+        if (n == 0)
+            break;
+        if (!pak_is_same_name(entry(i, filename), me.name)) {
+            fprintf(stderr, "ERROR: Entry %u doesn't match '%s'\n", i, entry(i, filename));
+            goto out;
+        }
+        if (me.hash[0] != 0) {
+            expected[i] = strtoull(me.hash, NULL, 16);
+            has_hash[i] = true;
+        }
+    }
+    manifest_close(&reader);
+
+    ctx.order = schedule_entries(entries64, is_pak64, hdr->nb_files, nb_jobs, has_hash, &ctx.nb_entries);
+    if (ctx.order == NULL)
+        goto out;
+    if (nb_jobs <= 1)
+        advise_sequential(pak->file);
+    ctx.pak = pak;
+    ctx.file = pak->file;
+    ctx.entries64 = entries64;
+    ctx.is_pak64 = is_pak64;
+    ctx.file_data_offset = pak->data_offset;
+    ctx.process = verify_entry;
+    if (!process_entries(&ctx, min(nb_jobs, ctx.nb_entries)))
+        goto out;
+
+    for (uint32_t i = 0; i < hdr->nb_files; i++) {
+        if (!has_hash[i])
+            continue;
+        nb_verified++;
+        if (ctx.hashes[i] != expected[i]) {
+            printf("MISMATCH %s\n", entry(i, filename));
+            nb_mismatches++;
+        }
+    }
+    printf("%u/%u entries verified", nb_verified, hdr->nb_files);
+    if (nb_verified != hdr->nb_files)
+        printf(" (no hash for %u)", hdr->nb_files - nb_verified);
+    printf(", %u mismatch%s\n", nb_mismatches, (nb_mismatches == 1) ? "" : "es");
+    r = (nb_mismatches == 0) ? 0 : -1;
+
+out:
+    manifest_close(&reader);
+    free(expected);
+    free(has_hash);
+    free(ctx.order);
+    free(ctx.hashes);
+    pak_close(pak);
+    return r;
+}
+
+// Hash the decoded data of the entries flagged in selected[], without writing anything
+static bool hash_entries(pak_file* pak, const bool* selected, uint64_t* hashes, uint32_t nb_jobs)
+{
+    pak_context ctx = { 0 };
+
+    ctx.order = schedule_entries(pak->entries64, pak->is_pak64, pak_count(pak), nb_jobs, selected, &ctx.nb_entries);
+    if (ctx.order == NULL)
+        return false;
+    if (nb_jobs <= 1)
+        advise_sequential(pak->file);
+    ctx.pak = pak;
+    ctx.file = pak->file;
+    ctx.entries64 = pak->entries64;
+    ctx.is_pak64 = pak->is_pak64;
+    ctx.file_data_offset = pak->data_offset;
+    ctx.hashes = hashes;
+    ctx.process = verify_entry;
+    bool r = process_entries(&ctx, min(nb_jobs, ctx.nb_entries));
+    free(ctx.order);
+    return r;
+}
+
+// Print the entries that were added, removed or changed between two archives, as
+// JSON. Entries are matched by name, and only the ones that have the same size in
+// both archives need to have their data read and hashed.
+static int diff_archives(const char* old_path, const char* new_path, uint32_t nb_jobs)
+{
+    int r = -1;
+    pak_file *old_pak = NULL, *new_pak = NULL;
+    uint32_t* matches = NULL;
+    bool *old_selected = NULL, *new_selected = NULL;
+    uint64_t *old_hashes = NULL, *new_hashes = NULL;
+    uint32_t nb_added = 0, nb_removed = 0, nb_changed = 0, nb_hashed = 0;
+    manifest_writer w;
+
+    // stdout is reserved for the JSON data
+    fprintf(stderr, "Comparing '%s' with '%s'...\n", basename(old_path), new_path);
+    old_pak = pak_open(old_path, 0);
+    new_pak = pak_open(new_path, 0);
+    if ((old_pak == NULL) || (new_pak == NULL))
+        goto out;
+    const uint32_t nb_old = pak_count(old_pak), nb_new = pak_count(new_pak);
+    // Either archive may be empty, and allocating 0 bytes may return NULL
+    matches = malloc(max(nb_new, 1) * sizeof(uint32_t));
+    old_selected = calloc(max(nb_old, 1), sizeof(bool));
+    new_selected = calloc(max(nb_new, 1), sizeof(bool));
+    old_hashes = calloc(max(nb_old, 1), sizeof(uint64_t));
+    new_hashes = calloc(max(nb_new, 1), sizeof(uint64_t));
+    if ((matches == NULL) || (old_selected == NULL) || (new_selected == NULL) ||
+        (old_hashes == NULL) || (new_hashes == NULL)) {
+        fprintf(stderr, "ERROR: Can't allocate entries\n");
+        goto out;
+    }
+    for (uint32_t i = 0; i < nb_new; i++) {
+        matches[i] = pak_find(old_pak, pak_entry_name(new_pak, i));
+        if ((matches[i] != UINT32_MAX) && (pak_entry_size(old_pak, matches[i]) == pak_entry_size(new_pak, i))) {
+            old_selected[matches[i]] = true;
+            new_selected[i] = true;
+            nb_hashed++;
+        }
+    }
+    if (!hash_entries(old_pak, old_selected, old_hashes, nb_jobs) ||
+        !hash_entries(new_pak, new_selected, new_hashes, nb_jobs))
+        goto out;
+
+    manifest_create(&w, NULL);
+    manifest_begin_object(&w, NULL);
+    manifest_begin_array(&w, "added");
+    for (uint32_t i = 0; i < nb_new; i++) {
+        if (matches[i] != UINT32_MAX)
+            continue;
+        manifest_begin_object(&w, NULL);
+        manifest_write_string(&w, "name", pak_entry_name(new_pak, i));
+        manifest_write_number(&w, "size", pak_entry_size(new_pak, i));
+        manifest_end_object(&w);
+        nb_added++;
+    }
+    manifest_end_array(&w);
+    manifest_begin_array(&w, "removed");
+    for (uint32_t j = 0; j < nb_old; j++) {
+        if (pak_find(new_pak, pak_entry_name(old_pak, j)) != UINT32_MAX)
+            continue;
+        manifest_begin_object(&w, NULL);
+        manifest_write_string(&w, "name", pak_entry_name(old_pak, j));
+        manifest_write_number(&w, "size", pak_entry_size(old_pak, j));
+        manifest_end_object(&w);
+        nb_removed++;
+    }
+    manifest_end_array(&w);
+    manifest_begin_array(&w, "changed");
+    for (uint32_t i = 0; i < nb_new; i++) {
+        const uint32_t j = matches[i];
+        if ((j == UINT32_MAX) || (new_selected[i] && (old_hashes[j] == new_hashes[i])))
+            continue;
+        manifest_begin_object(&w, NULL);
+        manifest_write_string(&w, "name", pak_entry_name(new_pak, i));
+        manifest_write_number(&w, "old_size", pak_entry_size(old_pak, j));
+        manifest_write_number(&w, "new_size", pak_entry_size(new_pak, i));
+        manifest_end_object(&w);
+        nb_changed++;
+    }
+    manifest_end_array(&w);
+    manifest_end_object(&w);
+    if (!manifest_finish(&w)) {
+        fprintf(stderr, "ERROR: Can't write JSON data\n");
+        goto out;
+    }
+    fprintf(stderr, "%u added, %u removed, %u changed (%u/%u entries hashed)\n",
+        nb_added, nb_removed, nb_changed, nb_hashed, nb_new);
+    r = 0;
+
+out:
+    free(matches);
+    free(old_selected);
+    free(new_selected);
+    free(old_hashes);
+    free(new_hashes);
+    pak_close(old_pak);
+    pak_close(new_pak);
+    return r;
+}
+
+// Options for the selection and extraction of entries
+typedef struct {
+    bool list_only;
+    bool use_mmap;
+    bool use_index;
+    bool use_uring;
+    bool use_direct;
+    uint32_t nb_jobs;
+    const char** includes;
+    const char** excludes;
+    const char** names;
+    uint32_t nb_includes;
+    uint32_t nb_excludes;
+    uint32_t nb_names;
+} extract_options;
+
+// Flag the entries matching the --include, --exclude and --entry options in *selected,
+// which is set to NULL if there are no such options.
+static bool select_entries(const pak_file* pak, const extract_options* opts, bool** selected)
+{
+    pak_entry64* entries64 = pak->entries64;
+    const bool is_pak64 = pak->is_pak64;
+    const uint32_t nb_files = pak->header.nb_files;
+    bool* sel;
+
+    *selected = NULL;
+    if ((opts->nb_includes == 0) && (opts->nb_excludes == 0) && (opts->nb_names == 0))
+        return true;
+    sel = calloc(nb_files, sizeof(bool));
+    if (sel == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate entries\n");
+        return false;
+    }
+    for (uint32_t i = 0; i < nb_files; i++) {
+        sel[i] = (opts->nb_includes == 0) && (opts->nb_names == 0);
+        for (uint32_t j = 0; (j < opts->nb_includes) && !sel[i]; j++)
+            sel[i] = pak_match_glob(opts->includes[j], entry(i, filename));
+    }
+    for (uint32_t j = 0; j < opts->nb_names; j++) {
+        uint32_t i = pak_find(pak, opts->names[j]);
+        if (i == UINT32_MAX)
+            fprintf(stderr, "WARNING: Can't find '%s' in archive\n", opts->names[j]);
+        else
+            sel[i] = true;
+    }
+    for (uint32_t i = 0; i < nb_files; i++) {
+        for (uint32_t j = 0; (j < opts->nb_excludes) && sel[i]; j++)
+            sel[i] = !pak_match_glob(opts->excludes[j], entry(i, filename));
+    }
+    *selected = sel;
+    return true;
+}
+
+// An archive being extracted, possibly along with other ones
+typedef struct {
+    const char* path;
+    pak_file* pak;
+    pak_context ctx;
+    journal journal;
+    bool* selected;
+    bool filtered;
+    uint64_t size;      // Total size of the entries to extract
+} extraction;
+
+static force_inline void list_entries(const bool is_pak64, const pak_file* pak, const bool* selected)
+{
+    pak_entry64* entries64 = pak->entries64;
+
+    printf("OFFSET    SIZE     NAME\n");
+    for (uint32_t i = 0; i < pak->header.nb_files; i++) {
+        if ((selected != NULL) && !selected[i])
+            continue;
+        printf("%09" PRIx64 " %08x %s%c\n", entry(i, data_offset) + pak->data_offset,
+            entry(i, size), entry(i, filename), pak_is_zero_key(entry(i, key)) ? '*' : ' ');
+    }
+}
+
+// Open an archive, list the entries to extract and create their directories.
+// Nothing is left to process after this call in list only mode.
+static bool start_extraction(extraction* x, const char* pak_path, const extract_options* opts)
+{
+    x->path = pak_path;
+    printf("%s '%s'...\n", opts->list_only ? "Listing" : "Extracting", basename(pak_path));
+    x->pak = pak_open(pak_path, ((opts->use_mmap && !opts->list_only) ? PAK_MAP : 0) |
+        (opts->use_index ? PAK_SIDECAR : 0));
+    if (x->pak == NULL)
+        return false;
+    pak_entry64* entries64 = x->pak->entries64;
+    const bool is_pak64 = x->pak->is_pak64;
+    const pak_header* hdr = &x->pak->header;
+    printf("Detected %s PAK format\n\n", is_pak64 ? "A18/64-bit" : "A17/32-bit");
+
+    // Only the names have been decoded at this stage, so we can select the
+    // entries we want before reading any data
+    if (!select_entries(x->pak, opts, &x->selected))
+        return false;
+    x->filtered = (x->selected != NULL);
+
+    pak_specialize(is_pak64, list_entries, x->pak, x->selected);
+    if (opts->list_only)
+        return true;
+
+    if (!create_directories(entries64, is_pak64, hdr->nb_files, x->selected))
+        return false;
+    x->ctx.order = schedule_entries(entries64, is_pak64, hdr->nb_files, opts->nb_jobs, x->selected, &x->ctx.nb_entries);
+    x->ctx.hashes = calloc(hdr->nb_files, sizeof(uint64_t));
+    x->ctx.mtimes = calloc(hdr->nb_files, sizeof(int64_t));
+    if ((x->ctx.order == NULL) || (x->ctx.hashes == NULL) || (x->ctx.mtimes == NULL))
+        return false;
+    // Skip the entries that an interrupted extraction already wrote. The ring only
+    // reports on the files it writes once it has been drained, so it gets no journal.
+    if (!opts->use_uring) {
+        uint32_t nb_done, nb_left = 0;
+        bool* done = calloc(hdr->nb_files, sizeof(bool));
+        if (done == NULL)
+            return false;
+        // The journal is only there to save work, so we can do without it
+        if (journal_open(&x->journal, change_extension(pak_path, ".journal"), pak_path, x->pak,
+            x->ctx.hashes, x->ctx.mtimes, done, &nb_done))
+            x->ctx.journal = &x->journal;
+        else
+            fprintf(stderr, "WARNING: Extracting without a journal\n");
+        for (uint32_t n = 0; n < x->ctx.nb_entries; n++) {
+            if (!done[x->ctx.order[n].index])
+                x->ctx.order[nb_left++] = x->ctx.order[n];
+        }
+        if (nb_left != x->ctx.nb_entries)
+            printf("\nResuming: %u entries were already extracted\n", x->ctx.nb_entries - nb_left);
+        x->ctx.nb_entries = nb_left;
+        free(done);
+    }
+    for (uint32_t n = 0; n < x->ctx.nb_entries; n++)
+        x->size += entry(x->ctx.order[n].index, size);
+    if ((opts->nb_jobs <= 1) && !opts->use_direct)
+        advise_sequential(x->pak->file);
+    x->ctx.pak = x->pak;
+    x->ctx.file = x->pak->file;
+    x->ctx.src = opts->use_mmap ? &x->pak->map : NULL;
+    x->ctx.entries64 = entries64;
+    x->ctx.is_pak64 = is_pak64;
+    x->ctx.file_data_offset = x->pak->data_offset;
+    x->ctx.process = is_pak64 ? extract_entry64 : extract_entry32;
+    x->ctx.use_uring = opts->use_uring;
+    x->ctx.use_direct = opts->use_direct;
+    x->ctx.direct = NO_DIRECT_FILE;
+    if (opts->use_direct) {
+        x->ctx.direct = open_direct(pak_path, false);
+        if (x->ctx.direct == NO_DIRECT_FILE) {
+            fprintf(stderr, "ERROR: Can't open '%s' for direct I/O\n", pak_path);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Store the data we'll need to reconstruct the archive to a JSON file
+static bool finish_extraction(extraction* x, const extract_options* opts)
+{
+    if (opts->list_only)
+        return true;
+    // A partial extraction can't be used to recreate the archive
+    if (!x->filtered) {
+        char json_path[256];
+        strncpy(json_path, change_extension(x->path, ".json"), sizeof(json_path) - 1);
+        json_path[sizeof(json_path) - 1] = 0;
+        if (!write_manifest(json_path, change_extension(basename(x->path), ".pak"), x->path, &x->pak->header,
+            x->pak->entries64, x->pak->is_pak64, false, x->ctx.mtimes, x->ctx.hashes))
+            return false;
+    }
+    // Everything has been extracted, so there is nothing left to resume
+    journal_close(&x->journal, true);
+    return true;
+}
+
+static void free_extraction(extraction* x)
+{
+    free(x->selected);
+    free(x->ctx.order);
+    free(x->ctx.hashes);
+    free(x->ctx.mtimes);
+    if (x->ctx.use_direct)
+        close_direct(x->ctx.direct);
+    journal_close(&x->journal, false);
+    pak_close(x->pak);
+}
+
+static int extract_archive(const char* pak_path, const extract_options* opts)
+{
+    int r = -1;
+    extraction x = { 0 };
+
+    if (!start_extraction(&x, pak_path, opts))
+        goto out;
+    if (!opts->list_only) {
+        // A single job can still overlap the reading, decoding and writing of the entries,
+        // provided that there is more than one CPU to run the stages on
+        if ((opts->nb_jobs <= 1) && (x.ctx.src == NULL) && !opts->use_uring && !opts->use_direct &&
+            (cpu_count() > 1)) {
+            if (!pipeline_entries(&x.ctx))
+                goto out;
+        } else if (!process_entries(&x.ctx, min(opts->nb_jobs, x.ctx.nb_entries))) {
+            goto out;
+        }
+    }
+    if (!finish_extraction(&x, opts))
+        goto out;
+    r = 0;
+
+out:
+    free_extraction(&x);
+    return r;
+}
+
+#define TAR_BLOCK_SIZE      512
+
+// Fill a POSIX (ustar) tar header block for a regular file
+static bool tar_header(uint8_t* block, const char* name, uint32_t size, int64_t mtime)
+{
+    const size_t len = strlen(name);
+    size_t split = 0;
+    uint32_t sum = 0;
+
+    memset(block, 0, TAR_BLOCK_SIZE);
+    // Names that are too long for the name field are split at a '/' into the prefix field
+    if (len > 100) {
+        for (split = min(len - 1, 155); (split > 0) && ((name[split] != '/') || (len - split - 1 > 100)); split--);
+        if (split == 0)
+            return false;
+        memcpy(&block[345], name, split);
+        name = &name[split + 1];
+    }
+    memcpy(&block[0], name, strlen(name));
+    snprintf((char*)&block[100], 8, "%07o", 0644);
+    snprintf((char*)&block[108], 8, "%07o", 0);
+    snprintf((char*)&block[116], 8, "%07o", 0);
+    snprintf((char*)&block[124], 12, "%011o", size);
+    // 11 octal digits are good until the year 2242
+    snprintf((char*)&block[136], 12, "%011" PRIo64, (uint64_t)min(max(mtime, 0), 077777777777LL));
+    block[156] = '0';
+    memcpy(&block[257], "ustar", 6);
+    memcpy(&block[263], "00", 2);
+    // The checksum is computed with its own field set to spaces
+    memset(&block[148], ' ', 8);
+    for (uint32_t i = 0; i < TAR_BLOCK_SIZE; i++)
+        sum += block[i];
+    snprintf((char*)&block[148], 8, "%06o", sum);
+    return true;
+}
+
+// Write the decoded entries of an archive as a tar stream to out_path, or to stdout if
+// out_path is "-", so that they can be fed to another tool without being extracted.
+// The entries are read in data order, and only a single chunk is ever held in memory.
+static int tar_archive(const char* pak_path, const char* out_path, const extract_options* opts)
+{
+    int r = -1;
+    pak_file* pak = NULL;
+    bool* selected = NULL;
+    sort_item* order = NULL;
+    uint8_t* buf = NULL;
+    FILE* out = NULL;
+    struct stat64 st;
+    uint32_t nb_entries = 0;
+    uint64_t size = 0;
+    char name[129];
+
+    // stdout is reserved for the tar data
+    fprintf(stderr, "Streaming '%s'...\n", basename(pak_path));
+    pak = pak_open(pak_path, opts->use_index ? PAK_SIDECAR : 0);
+    if (pak == NULL)
+        goto out;
+    pak_entry64* entries64 = pak->entries64;
+    const bool is_pak64 = pak->is_pak64;
+    const int64_t mtime = (stat64_utf8(pak_path, &st) == 0) ? (int64_t)st.st_mtime : 0;
+    if (!select_entries(pak, opts, &selected))
+        goto out;
+    order = schedule_entries(entries64, is_pak64, pak->header.nb_files, 1, selected, &nb_entries);
+    buf = malloc(CHUNK_SIZE);
+    if ((order == NULL) || (buf == NULL)) {
+        fprintf(stderr, "ERROR: Can't allocate buffer\n");
+        goto out;
+    }
+    if (strcmp(out_path, "-") == 0) {
+        out = stdout;
+#if defined(_WIN32)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    } else {
+        out = fopen_utf8(out_path, "wb");
+        if (out == NULL) {
+            fprintf(stderr, "ERROR: Can't create file '%s'\n", out_path);
+            goto out;
+        }
+    }
+    advise_sequential(pak->file);
 
-#pragma pack(push, 1)
-typedef struct {
-    uint32_t version;
-    uint32_t nb_files;
-    uint32_t header_size;
-    uint32_t flags;
-} pak_header;
+    for (uint32_t n = 0; n < nb_entries; n++) {
+        const uint32_t i = order[n].index;
+        // tar always uses '/', and the names are relative
+        size_t name_len = 0;
+        for (const char* c = entry(i, filename); (*c != 0) && (name_len < sizeof(name) - 1); c++) {
+            if ((name_len == 0) && ((*c == '/') || (*c == '\\')))
+                continue;
+            name[name_len++] = (*c == '\\') ? '/' : *c;
+        }
+        name[name_len] = 0;
+        if (!tar_header(buf, name, entry(i, size), mtime)) {
+            fprintf(stderr, "ERROR: Name '%s' is too long for tar\n", name);
+            goto out;
+        }
+        if (fwrite(buf, 1, TAR_BLOCK_SIZE, out) != TAR_BLOCK_SIZE)
+            goto write_error;
+        for (uint32_t pos = 0, len; pos < entry(i, size); pos += len) {
+            len = min(entry(i, size) - pos, CHUNK_SIZE);
+            if (!pak_read(pak, i, pos, len, buf)) {
+                fprintf(stderr, "ERROR: Can't read archive\n");
+                goto out;
+            }
+            if (fwrite(buf, 1, len, out) != len)
+                goto write_error;
+        }
+        // The data is padded to a whole number of blocks
+        const uint32_t pad = (TAR_BLOCK_SIZE - entry(i, size) % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        memset(buf, 0, TAR_BLOCK_SIZE);
+        if (fwrite(buf, 1, pad, out) != pad)
+            goto write_error;
+        size += entry(i, size);
+    }
+    // The end of the archive is marked by two empty blocks
+    memset(buf, 0, 2 * TAR_BLOCK_SIZE);
+    if ((fwrite(buf, 1, 2 * TAR_BLOCK_SIZE, out) != 2 * TAR_BLOCK_SIZE) || (fflush(out) != 0))
+        goto write_error;
+    fprintf(stderr, "Streamed %u entries (%.1f MB)\n", nb_entries, size / 1048576.0);
+    r = 0;
+    goto out;
+
+write_error:
+    fprintf(stderr, "ERROR: Can't write to '%s'\n", out_path);
+
+out:
+    if ((out != NULL) && (out != stdout) && (fclose(out) != 0) && (r == 0)) {
+        fprintf(stderr, "ERROR: Can't write to '%s'\n", out_path);
+        r = -1;
+    }
+    free(buf);
+    free(order);
+    free(selected);
+    pak_close(pak);
+    return r;
+}
 
+// State shared by the workers of a batch extraction. All the workers go through
+// the archives in the same order, and move to the next one as soon as all the
+// entries of the current one have been handed out, so that the smaller archives
+// fill the gaps left by the larger ones and no worker is left idle.
 typedef struct {
-    char     filename[128];
-    uint32_t size;
-    uint8_t  key[20];
-    uint32_t data_offset;
-    uint32_t flags;
-} pak_entry32;
+    extraction* x;
+    sort_item* order;
+    uint32_t nb_archives;
+    uint32_t next;
+    bool use_uring;
+    bool failed;            // Set if the batch failed outside of any archive
+    mutex_t lock;
+} batch_context;
+
+static THREAD_CALL batch_worker(void* arg)
+{
+    batch_context* batch = (batch_context*)arg;
+    worker_state ws = { 0 };
+    uint32_t n = 0;
+    pak_context *ctx, *prev_ctx = NULL;
+
+    if (batch->use_uring)
+        ws.ring = uring_create();
+    while (true) {
+        ctx = NULL;
+        mutex_lock(&batch->lock);
+        for (; batch->next < batch->nb_archives; batch->next++) {
+            ctx = &batch->x[batch->order[batch->next].index].ctx;
+            if (!ctx->failed && (ctx->next < ctx->nb_entries)) {
+                n = ctx->next++;
+                break;
+            }
+            ctx = NULL;
+        }
+        mutex_unlock(&batch->lock);
+        // Make sure that the files still in flight are attributed to their own archive
+        if ((ws.ring != NULL) && (prev_ctx != NULL) && (ctx != prev_ctx) && !uring_wait(ws.ring)) {
+            mutex_lock(&batch->lock);
+            prev_ctx->failed = true;
+            mutex_unlock(&batch->lock);
+        }
+        if (ctx == NULL)
+            break;
+        prev_ctx = ctx;
+        if (!ctx->process(ctx, n, &ws)) {
+            mutex_lock(&batch->lock);
+            ctx->failed = true;
+            mutex_unlock(&batch->lock);
+        }
+    }
+    if (!uring_destroy(ws.ring)) {
+        fprintf(stderr, "ERROR: Can't complete the pending writes\n");
+        mutex_lock(&batch->lock);
+        batch->failed = true;
+        mutex_unlock(&batch->lock);
+    }
+    free(ws.buf);
+    free_aligned(ws.direct_buf);
+    return 0;
+}
+
+static double get_time(void)
+{
+#if defined(_WIN32)
+    return GetTickCount64() / 1000.0;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1.0e9;
+#endif
+}
+
+// Extract multiple archives with a single pool of nb_jobs workers. An archive that
+// fails doesn't prevent the others from being extracted.
+static int extract_archives(char** pak_paths, uint32_t nb_paks, const extract_options* opts)
+{
+    int r = -1;
+    uint32_t nb_failed = 0, nb_extracted = 0, nb_entries = 0;
+    uint64_t size = 0;
+    thread_t* threads = NULL;
+    uint32_t nb_threads = 0;
+    batch_context batch = { 0 };
+    const double start = get_time();
+
+    batch.x = calloc(nb_paks, sizeof(extraction));
+    batch.order = calloc(nb_paks, sizeof(sort_item));
+    if ((batch.x == NULL) || (batch.order == NULL)) {
+        fprintf(stderr, "ERROR: Can't allocate archives\n");
+        goto out;
+    }
+    batch.nb_archives = nb_paks;
+    batch.use_uring = opts->use_uring;
+    for (uint32_t j = 0; j < nb_paks; j++) {
+        if (!start_extraction(&batch.x[j], pak_paths[j], opts)) {
+            fprintf(stderr, "ERROR: Can't extract '%s'\n", pak_paths[j]);
+            batch.x[j].ctx.failed = true;
+        }
+        printf("\n");
+        // Largest archives first
+        batch.order[j].index = j;
+        batch.order[j].value = UINT64_MAX - batch.x[j].size;
+    }
+    qsort(batch.order, nb_paks, sizeof(sort_item), compare_sort_items);
+
+    if (!opts->list_only) {
+        mutex_init(&batch.lock);
+        if (opts->nb_jobs > 1) {
+            threads = calloc(opts->nb_jobs, sizeof(thread_t));
+            // The main thread is one of the workers
+            for (; (threads != NULL) && (nb_threads < opts->nb_jobs - 1); nb_threads++) {
+                if (!thread_create(&threads[nb_threads], batch_worker, &batch))
+                    break;
+            }
+        }
+        batch_worker(&batch);
+        for (uint32_t i = 0; i < nb_threads; i++)
+            thread_join(threads[i]);
+        mutex_destroy(&batch.lock);
+    }
+
+    for (uint32_t j = 0; j < nb_paks; j++) {
+        if (batch.x[j].ctx.failed) {
+            nb_failed++;
+            continue;
+        }
+        if (!finish_extraction(&batch.x[j], opts)) {
+            nb_failed++;
+            continue;
+        }
+        nb_extracted++;
+        nb_entries += batch.x[j].ctx.nb_entries;
+        size += batch.x[j].size;
+    }
+    if (!opts->list_only) {
+        const double elapsed = max(get_time() - start, 0.001);
+        printf("Extracted %u entries (%.1f MB) from %u archive(s) in %.2f s: %.1f MB/s\n",
+            nb_entries, size / 1048576.0, nb_extracted, elapsed, size / 1048576.0 / elapsed);
+    }
+    if (nb_failed != 0)
+        fprintf(stderr, "ERROR: %u archive(s) could not be extracted\n", nb_failed);
+    else if (!batch.failed)
+        r = 0;
+
+out:
+    if (batch.x != NULL) {
+        for (uint32_t j = 0; j < nb_paks; j++)
+            free_extraction(&batch.x[j]);
+    }
+    free(batch.x);
+    free(batch.order);
+    free(threads);
+    return r;
+}
+
+static int compare_strings(const void* a, const void* b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+static bool add_archive(char*** paths, uint32_t* nb_paths, uint32_t* max_paths, const char* dir, const char* name)
+{
+    if (*nb_paths >= *max_paths) {
+        char** new_paths = realloc(*paths, 2 * (size_t)*max_paths * sizeof(char*));
+        if (new_paths == NULL)
+            return false;
+        *paths = new_paths;
+        *max_paths *= 2;
+    }
+    char* path = malloc(strlen(dir) + strlen(name) + 2);
+    if (path == NULL)
+        return false;
+    if (dir[0] != 0)
+        sprintf(path, "%s%c%s", dir, PATH_SEP, name);
+    else
+        strcpy(path, name);
+    // Don't extract the same archive twice, as the workers would compete for its files
+    for (uint32_t j = 0; j < *nb_paths; j++) {
+        if (strcmp((*paths)[j], path) == 0) {
+            free(path);
+            return true;
+        }
+    }
+    (*paths)[(*nb_paths)++] = path;
+    return true;
+}
 
+// Build the list of archives to process in batch mode, from a set of .pak files
+// and/or directories, where all the .pak files are picked. Returns NULL on error.
+static char** find_archives(char** args, uint32_t nb_args, uint32_t* nb_paths)
+{
+    uint32_t max_paths = 16;
+    char** paths = malloc(max_paths * sizeof(char*));
+    bool r = (paths != NULL);
+
+    *nb_paths = 0;
+    for (uint32_t j = 0; r && (j < nb_args); j++) {
+        if (!is_directory(args[j])) {
+            r = add_archive(&paths, nb_paths, &max_paths, "", args[j]);
+            continue;
+        }
+        const uint32_t first = *nb_paths;
+#if defined(_WIN32)
+        WIN32_FIND_DATAW fd;
+        char pattern[256];
+        snprintf(pattern, sizeof(pattern), "%s\\*.pak", args[j]);
+        wchar_t* wpattern = utf8_to_utf16(pattern);
+        HANDLE h = (wpattern == NULL) ? INVALID_HANDLE_VALUE : FindFirstFileW(wpattern, &fd);
+        free(wpattern);
+        if (h != INVALID_HANDLE_VALUE) {
+            do {
+                if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                    continue;
+                char* name = utf16_to_utf8(fd.cFileName);
+                r = (name != NULL) && add_archive(&paths, nb_paths, &max_paths, args[j], name);
+                free(name);
+            } while (r && FindNextFileW(h, &fd));
+            FindClose(h);
+        }
+#else
+        DIR* dir = opendir(args[j]);
+        struct dirent* de;
+        while (r && (dir != NULL) && ((de = readdir(dir)) != NULL)) {
+            size_t len = strlen(de->d_name);
+            if ((len > 4) && (strcasecmp(&de->d_name[len - 4], ".pak") == 0))
+                r = add_archive(&paths, nb_paths, &max_paths, args[j], de->d_name);
+        }
+        if (dir != NULL)
+            closedir(dir);
+#endif
+        // Directory listings are not sorted on all platforms
+        qsort(&paths[first], *nb_paths - first, sizeof(char*), compare_strings);
+    }
+    if (!r) {
+        fprintf(stderr, "ERROR: Can't allocate archives\n");
+        for (uint32_t j = 0; j < *nb_paths; j++)
+            free(paths[j]);
+        free(paths);
+        *nb_paths = 0;
+        return NULL;
+    }
+    return paths;
+}
+
+#if !defined(_WIN32)
+// Archives served by --serve. Requests are single lines of the form
+// "<offset> <length> <entry name>\n", where a length of 0 means up to the end of
+// the entry, and are answered with either "OK <size>\n" followed by the decoded
+// data, or "ERROR <message>\n". A connection can be used for multiple requests.
 typedef struct {
-    char     filename[128];
-    uint32_t size;
-    uint8_t  key[20];
-    uint64_t data_offset;
-    uint64_t flags;
-} pak_entry64;
-#pragma pack(pop)
+    pak_file** paks;
+    uint32_t nb_paks;
+    int fd;
+} connection;
 
-static __inline void decode(uint8_t* a, uint8_t* k, uint32_t size)
+static bool send_all(int fd, const void* buf, size_t size)
 {
-    for (uint32_t i = 0; i < size; i++)
-        a[i] ^= k[i % 20];
+    const uint8_t* p = (const uint8_t*)buf;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= (size_t)n;
+    }
+    return true;
 }
 
-static char* key_to_string(uint8_t* key)
+static bool send_entry(int fd, const pak_file* pak, uint32_t i, uint64_t offset, uint32_t size, uint8_t* buf)
 {
-    static char key_string[41];
-    for (size_t i = 0; i < 20; i++) {
-        key_string[2 * i] = ((key[i] >> 4) < 10) ? '0' + (key[i] >> 4) : 'a' + (key[i] >> 4) - 10;
-        key_string[2 * i + 1] = ((key[i] & 0xf) < 10) ? '0' + (key[i] & 0xf) : 'a' + (key[i] & 0xf) - 10;
+#if defined(__linux__)
+    // Unencrypted data can go straight from the page cache to the socket
+    if (pak_is_zero_key(pak_entry_key(pak, i))) {
+        off_t pos = (off_t)(pak_entry_offset(pak, i) + offset);
+        while (size > 0) {
+            ssize_t n = sendfile(fd, fileno(pak->file), &pos, size);
+            if ((n < 0) && (errno == EINTR))
+                continue;
+            if (n <= 0)
+                return false;
+            size -= (uint32_t)n;
+        }
+        return true;
     }
-    key_string[40] = 0;
-    return key_string;
+#endif
+    for (uint32_t pos = 0, len; pos < size; pos += len) {
+        len = min(size - pos, CHUNK_SIZE);
+        if (!pak_read(pak, i, offset + pos, len, buf) || !send_all(fd, buf, len))
+            return false;
+    }
+    return true;
 }
 
-static uint8_t* string_to_key(const char* str)
+static THREAD_CALL connection_worker(void* arg)
 {
-    static uint8_t key[20];
-    for (size_t i = 0; i < 20; i++) {
-        key[i] = (str[2 * i] >= 'a') ? str[2 * i] - 'a' + 10 : str[2 * i] - '0';
-        key[i] <<= 4;
-        key[i] += (str[2 * i + 1] >= 'a') ? str[2 * i + 1] - 'a' + 10 : str[2 * i + 1] - '0';
+    connection* con = (connection*)arg;
+    char line[512], header[64];
+    uint8_t* buf = malloc(CHUNK_SIZE);
+    FILE* in = fdopen(con->fd, "r");
+
+    while ((buf != NULL) && (in != NULL) && (fgets(line, sizeof(line), in) != NULL)) {
+        char *name, *end;
+        line[strcspn(line, "\r\n")] = 0;
+        uint64_t offset = strtoull(line, &end, 10);
+        uint64_t size = strtoull(end, &name, 10);
+        while (*name == ' ')
+            name++;
+        const pak_file* pak = NULL;
+        uint32_t i = UINT32_MAX;
+        for (uint32_t j = 0; (j < con->nb_paks) && (i == UINT32_MAX); j++) {
+            pak = con->paks[j];
+            i = pak_find(pak, name);
+        }
+        const char* error = NULL;
+        if (i == UINT32_MAX)
+            error = "Entry not found";
+        else if (offset > pak_entry_size(pak, i))
+            error = "Invalid offset";
+        else if (size == 0)
+            size = pak_entry_size(pak, i) - offset;
+        // offset + size could wrap around
+        else if (size > pak_entry_size(pak, i) - offset)
+            error = "Invalid size";
+        if (error != NULL) {
+            snprintf(header, sizeof(header), "ERROR %s\n", error);
+            if (!send_all(con->fd, header, strlen(header)))
+                break;
+            continue;
+        }
+        snprintf(header, sizeof(header), "OK %" PRIu64 "\n", size);
+        if (!send_all(con->fd, header, strlen(header)) ||
+            !send_entry(con->fd, pak, i, offset, (uint32_t)size, buf))
+            break;
     }
-    return key;
+    if (in != NULL)
+        fclose(in);
+    else
+        close(con->fd);
+    free(buf);
+    free(con);
+    return 0;
 }
 
-// To handle either 32 or 64 bit PAK entries
-#define entries32 ((pak_entry32*)entries64)
-#define entry(i, m) (is_pak64 ? entries64[i].m :(entries32[i]).m)
-#define set_entry(i, m, v) do {if (is_pak64) entries64[i].m = v; else (entries32[i]).m = (uint32_t)(v);} while(0)
+// Keep the archives opened, along with their name indexes, and serve their entries
+// over a Unix domain socket, until the process is killed.
+static int serve_archives(const char* socket_path, char** pak_paths, uint32_t nb_paks)
+{
+    int r = -1, fd = -1;
+    bool bound = false;
+    struct sockaddr_un addr = { 0 };
+    struct stat64 st;
+    pak_file** paks = calloc(nb_paks, sizeof(pak_file*));
+
+    if (paks == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate archives\n");
+        goto out;
+    }
+    for (uint32_t j = 0; j < nb_paks; j++) {
+        paks[j] = pak_open(pak_paths[j], PAK_MAP);
+        if (paks[j] == NULL)
+            goto out;
+        printf("Serving '%s' (%u entries)\n", pak_paths[j], pak_count(paks[j]));
+    }
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: Socket path is too long\n");
+        goto out;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    // Only a socket left over by a previous server may be replaced
+    if (lstat64(socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "ERROR: '%s' exists and is not a socket\n", socket_path);
+            goto out;
+        }
+        unlink(socket_path);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((fd < 0) || !(bound = (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0)) || (listen(fd, 64) != 0)) {
+        fprintf(stderr, "ERROR: Can't listen on '%s'\n", socket_path);
+        goto out;
+    }
+    // Clients going away must not terminate the server
+    signal(SIGPIPE, SIG_IGN);
+    printf("Listening on '%s'\n", socket_path);
+    fflush(stdout);
+
+    while (true) {
+        thread_t thread;
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ERROR: Can't accept connection\n");
+            goto out;
+        }
+        connection* con = malloc(sizeof(connection));
+        if (con == NULL) {
+            close(client);
+            continue;
+        }
+        con->paks = paks;
+        con->nb_paks = nb_paks;
+        con->fd = client;
+        if (thread_create(&thread, connection_worker, con)) {
+            pthread_detach(thread);
+        } else {
+            close(client);
+            free(con);
+        }
+    }
+
+out:
+    if (fd >= 0)
+        close(fd);
+    if (bound)
+        unlink(socket_path);
+    if (paks != NULL) {
+        for (uint32_t j = 0; j < nb_paks; j++)
+            pak_close(paks[j]);
+        free(paks);
+    }
+    return r;
+}
+
+static int compare_uint64(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Fetch an entry from a --serve instance and write it to stdout or, if nb_requests
+// is not zero, fetch it nb_requests times and report the latency instead.
+static int get_entry(const char* socket_path, const char* name, uint32_t nb_requests)
+{
+    int r = -1, fd = -1;
+    struct sockaddr_un addr = { 0 };
+    char line[512];
+    FILE* in = NULL;
+    uint8_t* buf = malloc(CHUNK_SIZE);
+    uint64_t* latencies = calloc(max(nb_requests, 1), sizeof(uint64_t));
+
+    if ((buf == NULL) || (latencies == NULL)) {
+        fprintf(stderr, "ERROR: Can't allocate buffer\n");
+        goto out;
+    }
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: Socket path is too long\n");
+        goto out;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((fd < 0) || (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)) {
+        fprintf(stderr, "ERROR: Can't connect to '%s'\n", socket_path);
+        goto out;
+    }
+    in = fdopen(fd, "r");
+    if (in == NULL)
+        goto out;
+    snprintf(line, sizeof(line), "0 0 %s\n", name);
+
+    for (uint32_t n = 0; n < max(nb_requests, 1); n++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!send_all(fd, line, strlen(line)) || (fgets(line, sizeof(line), in) == NULL)) {
+            fprintf(stderr, "ERROR: No answer from server\n");
+            goto out;
+        }
+        if (strncmp(line, "OK ", 3) != 0) {
+            fprintf(stderr, "ERROR: %s", (strncmp(line, "ERROR ", 6) == 0) ? &line[6] : line);
+            goto out;
+        }
+        uint64_t size = strtoull(&line[3], NULL, 10);
+        while (size > 0) {
+            size_t len = fread(buf, 1, (size_t)min(size, CHUNK_SIZE), in);
+            if (len == 0) {
+                fprintf(stderr, "ERROR: Can't read data from server\n");
+                goto out;
+            }
+            if ((nb_requests == 0) && (fwrite(buf, 1, len, stdout) != len)) {
+                fprintf(stderr, "ERROR: Can't write data\n");
+                goto out;
+            }
+            size -= len;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        latencies[n] = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL + (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
+        snprintf(line, sizeof(line), "0 0 %s\n", name);
+    }
+    if (nb_requests != 0) {
+        qsort(latencies, nb_requests, sizeof(uint64_t), compare_uint64);
+        printf("%u requests: p50 = %.1f us, p99 = %.1f us\n", nb_requests,
+            latencies[nb_requests / 2] / 1000.0, latencies[(nb_requests * 99) / 100] / 1000.0);
+    }
+    r = 0;
+
+out:
+    if (in != NULL)
+        fclose(in);
+    else if (fd >= 0)
+        close(fd);
+    free(latencies);
+    free(buf);
+    return r;
+}
+#endif
 
 int main_utf8(int argc, char** argv)
 {
     int r = -1;
     FILE* file = NULL;
-    uint8_t* buf = NULL;
-    char path[256];
+    char path[256], tmp_path[264] = { 0 };
     pak_header hdr = { 0 };
     pak_entry64* entries64 = NULL;
-    JSON_Value* json = NULL;
-    bool is_pak64 = false;
-    bool list_only = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'l');
+    pak_file* old_pak = NULL;
+    manifest_reader reader = { 0 };
+    manifest_header mh;
+    manifest_entry me;
+    pak_context ctx = { 0 };
+    struct stat64 st;
+    bool is_pak64 = false, incremental = false, verify = false, dedup = false;
+    uint32_t* dup_slots = NULL;
+    const char* replace_pak = NULL, *replace_name = NULL, *get_socket = NULL, *diff_pak = NULL;
+    const char* tar_path = NULL;
+    uint32_t nb_requests = 0, nb_paks = 0;
+    char** pak_paths = NULL;
+    // Don't wait for a key press on error in batch mode, or when stdout is used for data
+    bool no_pause = false;
+    bool* selected = NULL;
+    extract_options opts = { 0 };
+    int argn;
+
+    opts.nb_jobs = 1;
+    opts.includes = calloc(argc, sizeof(char*));
+    opts.excludes = calloc(argc, sizeof(char*));
+    opts.names = calloc(argc, sizeof(char*));
+    if ((opts.includes == NULL) || (opts.excludes == NULL) || (opts.names == NULL)) {
+        fprintf(stderr, "ERROR: Can't allocate options\n");
+        goto out;
+    }
+
+    if ((argc >= 4) && (strcmp(argv[1], "--serve") == 0)) {
+#if defined(_WIN32)
+        fprintf(stderr, "ERROR: --serve is not supported on this platform\n");
+#else
+        r = serve_archives(argv[2], &argv[3], (uint32_t)(argc - 3));
+#endif
+        goto out;
+    }
+
+    for (argn = 1; (argn < argc - 1) && (argv[argn][0] == '-'); argn++) {
+        if (strcmp(argv[argn], "-l") == 0) {
+            opts.list_only = true;
+        } else if (strcmp(argv[argn], "-m") == 0) {
+            opts.use_mmap = true;
+        } else if ((strncmp(argv[argn], "-j", 2) == 0) && ((argv[argn][2] != 0) || (argn < argc - 2))) {
+            opts.nb_jobs = (uint32_t)strtoul((argv[argn][2] != 0) ? &argv[argn][2] : argv[++argn], NULL, 10);
+            if (opts.nb_jobs == 0)
+                opts.nb_jobs = cpu_count();
+        } else if (strcmp(argv[argn], "--incremental") == 0) {
+            incremental = true;
+        } else if (strcmp(argv[argn], "--index") == 0) {
+            opts.use_index = true;
+        } else if (strcmp(argv[argn], "--uring") == 0) {
+            opts.use_uring = true;
+        } else if (strcmp(argv[argn], "--direct") == 0) {
+            opts.use_direct = true;
+        } else if (strcmp(argv[argn], "--verify") == 0) {
+            verify = true;
+        } else if (strcmp(argv[argn], "--dedup") == 0) {
+            dedup = true;
+        } else if ((strcmp(argv[argn], "--replace") == 0) && (argn < argc - 3)) {
+            replace_pak = argv[++argn];
+            replace_name = argv[++argn];
+        } else if ((strcmp(argv[argn], "--diff") == 0) && (argn < argc - 2)) {
+            diff_pak = argv[++argn];
+        } else if ((strcmp(argv[argn], "--tar") == 0) && (argn < argc - 2)) {
+            tar_path = argv[++argn];
+        } else if ((strcmp(argv[argn], "--get") == 0) && (argn < argc - 2)) {
+            get_socket = argv[++argn];
+        } else if ((strcmp(argv[argn], "--bench") == 0) && (argn < argc - 2)) {
+            nb_requests = (uint32_t)strtoul(argv[++argn], NULL, 10);
+        } else if ((strcmp(argv[argn], "--include") == 0) && (argn < argc - 2)) {
+            opts.includes[opts.nb_includes++] = argv[++argn];
+        } else if ((strcmp(argv[argn], "--exclude") == 0) && (argn < argc - 2)) {
+            opts.excludes[opts.nb_excludes++] = argv[++argn];
+        } else if ((strcmp(argv[argn], "--entry") == 0) && (argn < argc - 2)) {
+            opts.names[opts.nb_names++] = argv[++argn];
+        } else {
+            break;
+        }
+    }
 
-    if ((argc != 2) && !list_only) {
+    if ((argc < 2) || ((argn != argc - 1) && ((replace_pak != NULL) || (diff_pak != NULL) ||
+        (tar_path != NULL) || (get_socket != NULL) || verify))) {
         printf("%s %s (c) 2018-2019 Yuri Hime & VitaSmith\n\n"
-            "Usage: %s [-l] <Gust PAK file>\n\n"
-            "Extracts (.pak) or recreates (.json) a Gust .pak archive.\n\n",
-            appname(argv[0]), GUST_TOOLS_VERSION_STR, appname(argv[0]));
-        return 0;
+            "Usage: %s [-l] [-m] [-j N] [--incremental] [--dedup] [--index] [--uring|--direct] <Gust PAK file>\n"
+            "       %s [-l] [-m] [-j N] [--index] [--uring|--direct] <Gust PAK file|directory> [...]\n"
+            "       %s --replace <Gust PAK file> <entry name> <file>\n"
+            "       %s --verify [-j N] <Gust PAK file>\n"
+            "       %s [-j N] --diff <old Gust PAK file> <new Gust PAK file>\n"
+            "       %s --tar <tar file|-> <Gust PAK file>\n"
+            "       %s --serve <socket> <Gust PAK file> [<Gust PAK file> ...]\n"
+            "       %s --get <socket> [--bench N] <entry name>\n\n"
+            "Extracts (.pak) or recreates (.json) a Gust .pak archive, replaces a single\n"
+            "entry of an existing archive, verifies an archive against the hashes from\n"
+            "the .json that was created during extraction, compares two archives, streams\n"
+            "an archive as tar, or serves the entries of one or more archives over a Unix\n"
+            "domain socket.\n"
+            "Multiple archives, or all the archives from a directory, can be extracted\n"
+            "at once, in which case all the jobs are shared between the archives, and\n"
+            "%s never waits for a key press on error.\n\n"
+            "Options:\n"
+            "  -l             List the content of the archive only\n"
+            "  -m             Use memory mapped I/O to extract the archive\n"
+            "  -j N           Use N parallel jobs (0 = one per CPU)\n"
+            "  --incremental  When recreating an archive, reuse the data of the files\n"
+            "                 that haven't changed since extraction from the existing\n"
+            "                 archive, and update the .json accordingly\n"
+            "  --dedup        When recreating an archive, only store the data of files\n"
+            "                 that have the same content and key once\n"
+            "  --replace      Replace the data of an entry in place, or append it at the\n"
+            "                 end of the archive if it is larger than the original\n"
+            "  --verify       Check that the decoded data of every entry matches the hash\n"
+            "                 recorded in the .json, without writing anything\n"
+            "  --diff         Print the entries that were added, removed or changed\n"
+            "                 between two archives as JSON, without writing anything\n"
+            "  --tar FILE     Write the decoded entries as a tar archive to FILE, or to\n"
+            "                 the standard output if FILE is '-', without extracting them\n"
+            "  --include GLOB Only list or extract the entries matching GLOB\n"
+            "  --exclude GLOB Don't list or extract the entries matching GLOB\n"
+            "  --entry NAME   Only list or extract the entry called NAME\n"
+            "  --index        Use a .pakidx file, created alongside the archive, to\n"
+            "                 speed up subsequent listings or extractions\n"
+            "  --uring        Use io_uring to write the extracted files, if available\n"
+            "  --direct       Use direct I/O for the data of the entries, so that it doesn't\n"
+            "                 go through the OS cache, when extracting or creating an archive\n"
+            "  --serve        Keep the archives opened and serve the decoded data of\n"
+            "                 their entries to --get requests, until killed\n"
+            "  --get          Fetch an entry from a --serve instance and write it to\n"
+            "                 the standard output\n"
+            "  --bench N      With --get, fetch the entry N times and report the p50 and\n"
+            "                 p99 request latencies instead\n\n"
+            "--include, --exclude and --entry can be repeated, and also apply to --tar.\n"
+            "Since a partial extraction can't be used to recreate the archive, no .json is\n"
+            "created in that case.\n",
+            appname(argv[0]), GUST_TOOLS_VERSION_STR, appname(argv[0]), appname(argv[0]), appname(argv[0]),
+            appname(argv[0]), appname(argv[0]), appname(argv[0]), appname(argv[0]), appname(argv[0]),
+            appname(argv[0]));
+        r = 0;
+        goto out;
+    }
+
+    if (replace_pak != NULL) {
+        r = replace_entry(replace_pak, replace_name, argv[argc - 1]);
+        goto out;
+    }
+
+    if (get_socket != NULL) {
+        no_pause = true;
+#if defined(_WIN32)
+        fprintf(stderr, "ERROR: --get is not supported on this platform\n");
+#else
+        r = get_entry(get_socket, argv[argc - 1], nb_requests);
+#endif
+        goto out;
+    }
+
+    if (tar_path != NULL) {
+        no_pause = (strcmp(tar_path, "-") == 0);
+        r = tar_archive(argv[argc - 1], tar_path, &opts);
+        goto out;
     }
 
-    if (is_directory(argv[argc - 1])) {
+    if (diff_pak != NULL) {
+        no_pause = true;
+        r = diff_archives(diff_pak, argv[argc - 1], opts.nb_jobs);
+        goto out;
+    }
+
+    if (verify) {
+        r = verify_archive(argv[argc - 1], opts.nb_jobs);
+        goto out;
+    }
+
+    if (opts.use_direct && (opts.use_mmap || opts.use_uring)) {
+        fprintf(stderr, "ERROR: Option --direct can't be combined with -m or --uring\n");
+        goto out;
+    }
+    if (opts.use_uring) {
+        uring* ring = uring_create();
+        if (ring == NULL) {
+            fprintf(stderr, "WARNING: io_uring is not available - using regular I/O\n");
+            opts.use_uring = false;
+        }
+        uring_destroy(ring);
+    }
+
+    if ((argn != argc - 1) || is_directory(argv[argc - 1])) {
+        pak_paths = find_archives(&argv[argn], (uint32_t)(argc - argn), &nb_paks);
+        if (pak_paths == NULL)
+            goto out;
+    }
+    if (nb_paks != 0) {
+        if (incremental || dedup) {
+            fprintf(stderr, "ERROR: Options --incremental and --dedup are not supported in batch mode\n");
+            goto out;
+        }
+        no_pause = true;
+        r = extract_archives(pak_paths, nb_paks, &opts);
+    } else if (argn != argc - 1) {
+        fprintf(stderr, "ERROR: No archive to process\n");
+    } else if (is_directory(argv[argc - 1])) {
         fprintf(stderr, "ERROR: Directory packing is not supported.\n"
             "To recreate a .pak you need to use the corresponding .json file.\n");
     } else if (strstr(argv[argc - 1], ".json") != NULL) {
-        if (list_only) {
+        if (opts.list_only) {
             fprintf(stderr, "ERROR: Option -l is not supported when creating an archive\n");
             goto out;
         }
-        json = json_parse_file_with_comments(argv[argc - 1]);
-        if (json == NULL) {
-            fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", argv[argc - 1]);
+        if (opts.use_mmap) {
+            fprintf(stderr, "ERROR: Option -m is not supported when creating an archive\n");
             goto out;
         }
-        const char* filename = json_object_get_string(json_object(json), "name");
-        hdr.header_size = (uint32_t)json_object_get_number(json_object(json), "header_size");
-        if ((filename == NULL) || (hdr.header_size != sizeof(pak_header))) {
-            fprintf(stderr, "ERROR: No filename/wrong header size\n");
+        if ((opts.nb_includes != 0) || (opts.nb_excludes != 0) || (opts.nb_names != 0)) {
+            fprintf(stderr, "ERROR: Entry selection is not supported when creating an archive\n");
             goto out;
         }
-        hdr.version = (uint32_t)json_object_get_number(json_object(json), "version");
-        hdr.flags = (uint32_t)json_object_get_number(json_object(json), "flags");
-        hdr.nb_files = (uint32_t)json_object_get_number(json_object(json), "nb_files");
-        is_pak64 = json_object_get_boolean(json_object(json), "64-bit");
-        printf("Creating '%s'...\n", filename);
-        create_backup(filename);
-        file = fopen_utf8(filename, "wb+");
-        if (file == NULL) {
-            fprintf(stderr, "ERROR: Can't create file '%s'\n", filename);
+        // The entries are read from the .json one at a time, as we lay them out
+        if (!manifest_open(&reader, argv[argc - 1], &mh))
+            goto out;
+        hdr.header_size = mh.header_size;
+        if ((mh.name[0] == 0) || (hdr.header_size != sizeof(pak_header))) {
+            fprintf(stderr, "ERROR: No filename/wrong header size\n");
             goto out;
         }
-        if (fwrite(&hdr, sizeof(pak_header), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't write PAK header\n");
+        const char* pak_name = mh.name;
+        hdr.version = mh.version;
+        hdr.flags = mh.flags;
+        hdr.nb_files = mh.nb_files;
+        is_pak64 = mh.is_pak64;
+        printf("Creating '%s'...\n", pak_name);
+
+        if (incremental) {
+            // We can only reuse data from the archive the .json was last synced with
+            if ((stat64_utf8(pak_name, &st) == 0) &&
+                ((uint64_t)st.st_size == mh.archive_size) && ((int64_t)st.st_mtime == mh.archive_mtime))
+                old_pak = pak_open(pak_name, 0);
+            if ((old_pak != NULL) && ((pak_count(old_pak) != hdr.nb_files) || (old_pak->is_pak64 != is_pak64))) {
+                pak_close(old_pak);
+                old_pak = NULL;
+            }
+            if (old_pak != NULL)
+                ctx.old_file = old_pak->file;
+            else
+                printf("Existing archive doesn't match '%s' - Recreating all entries\n", argv[argc - 1]);
+        }
+
+        // When reusing data from the existing archive, we write the new one on the side
+        if (ctx.old_file != NULL) {
+            snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", pak_name);
+            file = fopen_utf8(tmp_path, "wb+");
+        } else {
+            create_backup(pak_name);
+            file = fopen_utf8(pak_name, "wb+");
+        }
+        if (file == NULL) {
+            fprintf(stderr, "ERROR: Can't create file '%s'\n", (tmp_path[0] != 0) ? tmp_path : pak_name);
             goto out;
         }
         entries64 = calloc(hdr.nb_files, sizeof(pak_entry64));
-        if (entries64 == NULL) {
+        ctx.paths = calloc(hdr.nb_files, sizeof(char*));
+        ctx.hashes = calloc(hdr.nb_files, sizeof(uint64_t));
+        ctx.mtimes = calloc(hdr.nb_files, sizeof(int64_t));
+        ctx.reuse_offsets = malloc(hdr.nb_files * sizeof(uint64_t));
+        if ((entries64 == NULL) || (ctx.paths == NULL) || (ctx.hashes == NULL) ||
+            (ctx.mtimes == NULL) || (ctx.reuse_offsets == NULL)) {
             fprintf(stderr, "ERROR: Can't allocate entries\n");
             goto out;
         }
-        // Write a dummy table for now
-        if (fwrite(entries64, is_pak64 ? sizeof(pak_entry64) : sizeof(pak_entry32),
-            hdr.nb_files, file) != hdr.nb_files) {
-            fprintf(stderr, "ERROR: Can't write initial PAK table\n");
-            goto out;
+        uint32_t dup_mask = 15;
+        if (dedup) {
+            while (dup_mask < 2 * hdr.nb_files)
+                dup_mask = 2 * dup_mask + 1;
+            dup_slots = calloc((size_t)dup_mask + 1, sizeof(uint32_t));
+            selected = calloc(hdr.nb_files, sizeof(bool));
+            if ((dup_slots == NULL) || (selected == NULL)) {
+                fprintf(stderr, "ERROR: Can't allocate entries\n");
+                goto out;
+            }
         }
-        uint64_t file_data_offset = ftell64(file);
+        uint64_t file_data_offset = sizeof(pak_header) +
+            (uint64_t)hdr.nb_files * (is_pak64 ? sizeof(pak_entry64) : sizeof(pak_entry32));
 
-        JSON_Array* json_files_array = json_object_get_array(json_object(json), "files");
+        // Lay out all the entries first, so that their data can then be written in any order
+        uint64_t data_offset = 0, dup_size = 0;
+        uint32_t nb_reused = 0, nb_dups = 0;
         printf("OFFSET    SIZE     NAME\n");
         for (uint32_t i = 0; i < hdr.nb_files; i++) {
-            JSON_Object* file_entry = json_array_get_object(json_files_array, i);
-            uint8_t* key = string_to_key(json_object_get_string(file_entry, "key"));
-            filename = json_object_get_string(file_entry, "name");
-            strncpy(entry(i, filename), filename, 127);
-            strncpy(path, filename, sizeof(path) - 1);
+            int n = manifest_read_entry(&reader, &me);
+            if (n <= 0) {
+                if (n == 0)
+                    fprintf(stderr, "ERROR: Number of entries doesn't match\n");
+                goto out;
+            }
+            if (strlen(me.key) != 2 * PAK_KEY_SIZE) {
+                fprintf(stderr, "ERROR: Invalid key for '%s'\n", me.name);
+                goto out;
+            }
+            uint8_t* key = string_to_key(me.key);
+            const size_t len = strlen(me.name);
+            if (len >= sizeof(entries64[0].filename)) {
+                fprintf(stderr, "ERROR: Name '%s' is too long\n", me.name);
+                goto out;
+            }
+            memcpy(entry(i, filename), me.name, len + 1);
+            memcpy(path, me.name, len + 1);
             for (size_t n = 0; n < strlen(path); n++) {
                 if (path[n] == '\\')
                     path[n] = PATH_SEP;
             }
-            set_entry(i, size, read_file(&path[1], &buf));
-            if (entry(i, size) == 0) {
+            if (path[0] != PATH_SEP) {
+                fprintf(stderr, "ERROR: Invalid name '%s'\n", me.name);
+                goto out;
+            }
+            ctx.paths[i] = malloc(len);
+            if (ctx.paths[i] == NULL) {
+                fprintf(stderr, "ERROR: Can't allocate entries\n");
+                goto out;
+            }
+            strcpy(ctx.paths[i], &path[1]);
+            if ((stat64_utf8(ctx.paths[i], &st) != 0) || !S_ISREG(st.st_mode) ||
+                (st.st_size == 0) || ((uint64_t)st.st_size > UINT32_MAX)) {
                 fprintf(stderr, "ERROR: Can't read from '%s'\n", path);
                 goto out;
             }
-            bool skip_encode = true;
-            for (int j = 0; j < 20; j++) {
-                entry(i, key)[j] = key[j];
-                if (key[j] != 0)
-                    skip_encode = false;
+            set_entry(i, size, (uint32_t)st.st_size);
+            memcpy(entry(i, key), key, PAK_KEY_SIZE);
+            bool skip_encode = pak_is_zero_key(key);
+
+            // An entry can be reused if the previous archive has it with the same name, size and
+            // key, and the file has the same size and either the same mtime or the same content.
+            // The mtime is only trusted if it is older than the time the manifest recorded it.
+            // Entries without a recorded hash, from older manifests, are never reused, so that
+            // every entry of the new manifest gets one.
+            ctx.mtimes[i] = (int64_t)st.st_mtime;
+            ctx.reuse_offsets[i] = UINT64_MAX;
+            if ((old_pak != NULL) && (me.hash[0] != 0) &&
+                (strcmp(pak_entry_name(old_pak, i), path) == 0) &&
+                (pak_entry_size(old_pak, i) == entry(i, size)) &&
+                (memcmp(pak_entry_key(old_pak, i), key, PAK_KEY_SIZE) == 0) &&
+                (me.size == entry(i, size))) {
+                uint64_t hash = strtoull(me.hash, NULL, 16);
+                if (((me.mtime == ctx.mtimes[i]) && (me.mtime < mh.timestamp)) ||
+                    (hash_file(ctx.paths[i], &ctx.hashes[i]) && (ctx.hashes[i] == hash))) {
+                    ctx.hashes[i] = hash;
+                    ctx.reuse_offsets[i] = pak_entry_offset(old_pak, i);
+                    nb_reused++;
+                }
             }
 
-            set_entry(i, data_offset, ftell64(file) - file_data_offset);
-            uint64_t flags = (uint64_t)json_object_get_number(file_entry, "flags");
+            // Duplicates share the data of the first identical entry, and don't get written
+            uint32_t j = UINT32_MAX;
+            if (dedup) {
+                if ((ctx.reuse_offsets[i] == UINT64_MAX) && !hash_file(ctx.paths[i], &ctx.hashes[i]))
+                    goto out;
+                j = find_duplicate(dup_slots, dup_mask, entries64, is_pak64, ctx.hashes, ctx.paths, i);
+                selected[i] = (j == UINT32_MAX);
+            }
+            if (j != UINT32_MAX) {
+                set_entry(i, data_offset, entry(j, data_offset));
+                dup_size += entry(i, size);
+                nb_dups++;
+            } else {
+                // The offsets of a 32-bit archive are truncated past 4 GB
+                if (!is_pak64 && (data_offset + entry(i, size) > UINT32_MAX)) {
+                    fprintf(stderr, "ERROR: Data is too large for a 32-bit archive\n");
+                    goto out;
+                }
+                set_entry(i, data_offset, data_offset);
+                data_offset += entry(i, size);
+            }
             if (is_pak64)
-                setbe64(&(entries64[i].flags), flags);
+                setbe64(&(entries64[i].flags), me.flags);
             else
-                setbe32(&(entries32[i].flags), (uint32_t)flags);
+                setbe32(&(entries32[i].flags), (uint32_t)me.flags);
             printf("%09" PRIx64 " %08x %s%c\n", entry(i, data_offset) + file_data_offset,
                 entry(i, size), entry(i, filename), skip_encode ? '*' : ' ');
-            if (!skip_encode) {
-                decode((uint8_t*)entry(i, filename), entry(i, key), 128);
-                decode(buf, entry(i, key), entry(i, size));
-            }
-            if (fwrite(buf, 1, entry(i, size), file) != entry(i, size)) {
-                fprintf(stderr, "ERROR: Can't write data for '%s'\n", path);
-                goto out;
-            }
-            free(buf);
-            buf = NULL;
-        }
-        fseek64(file, sizeof(pak_header), SEEK_SET);
-        if (fwrite(entries64, is_pak64 ? sizeof(pak_entry64) : sizeof(pak_entry32),
-            hdr.nb_files, file) != hdr.nb_files) {
-            fprintf(stderr, "ERROR: Can't write PAK table\n");
-            goto out;
-        }
-        r = 0;
-    } else {
-        printf("%s '%s'...\n", list_only ? "Listing" : "Extracting", basename(argv[argc - 1]));
-        file = fopen_utf8(argv[argc - 1], "rb");
-        if (file == NULL) {
-            fprintf(stderr, "ERROR: Can't open PAK file '%s'", argv[argc - 1]);
-            goto out;
+            if (!skip_encode)
+                pak_decode((uint8_t*)entry(i, filename), (uint8_t*)entry(i, filename), entry(i, key), 128, 0);
         }
 
-        if (fread(&hdr, sizeof(hdr), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't read hdr");
-            goto out;
-        }
+        manifest_close(&reader);
 
-        if ((hdr.version != 0x20000) || (hdr.header_size != sizeof(pak_header))) {
-            fprintf(stderr, "ERROR: Signature doesn't match expected PAK file format.\n");
+        ctx.order = schedule_entries(entries64, is_pak64, hdr.nb_files, opts.nb_jobs, selected, &ctx.nb_entries);
+        if (ctx.order == NULL)
             goto out;
+        ctx.file = file;
+        ctx.entries64 = entries64;
+        ctx.is_pak64 = is_pak64;
+        ctx.file_data_offset = file_data_offset;
+        ctx.process = is_pak64 ? pack_entry64 : pack_entry32;
+        if (opts.use_direct) {
+            ctx.direct = open_direct((tmp_path[0] != 0) ? tmp_path : pak_name, true);
+            if (ctx.direct == NO_DIRECT_FILE) {
+                fprintf(stderr, "ERROR: Can't open '%s' for direct I/O\n", (tmp_path[0] != 0) ? tmp_path : pak_name);
+                goto out;
+            }
+            ctx.use_direct = true;
         }
-        if (hdr.nb_files > 16384) {
-            fprintf(stderr, "ERROR: Too many entries.\n");
+        if (!process_entries(&ctx, min(opts.nb_jobs, ctx.nb_entries)))
             goto out;
+        if (ctx.use_direct) {
+            close_direct(ctx.direct);
+            ctx.use_direct = false;
         }
-
-        entries64 = calloc(hdr.nb_files, sizeof(pak_entry64));
-        if (entries64 == NULL) {
-            fprintf(stderr, "ERROR: Can't allocate entries\n");
+        if (!write_at(file, &hdr, sizeof(pak_header), 0)) {
+            fprintf(stderr, "ERROR: Can't write PAK header\n");
             goto out;
         }
-
-        if (fread(entries64, sizeof(pak_entry64), hdr.nb_files, file) != hdr.nb_files) {
-            fprintf(stderr, "ERROR: Can't read PAK hdr\n");
+        if (!write_at(file, entries64, (size_t)(file_data_offset - sizeof(pak_header)), sizeof(pak_header))) {
+            fprintf(stderr, "ERROR: Can't write PAK table\n");
             goto out;
         }
+        fclose(file);
+        file = NULL;
 
-        // Detect if we are dealing with 32 or 64-bit pak entries by checking
-        // the data_offsets at the expected 32 and 64-bit struct location and
-        // adding the absolute value of the difference with last data_offset.
-        // The sum that is closest to zero tells us if we are dealing with a
-        // 32 or 64-bit PAK archive.
-        uint64_t sum[2] = { 0, 0 };
-        uint32_t val[2], last[2] = { 0, 0 };
-        for (uint32_t i = 0; i < min(hdr.nb_files, 64); i++) {
-            val[0] = ((pak_entry32*)entries64)[i].data_offset;
-            val[1] = (uint32_t)(entries64[i].data_offset >> 32);
-            for (int j = 0; j < 2; j++) {
-                sum[j] += (val[j] > last[j]) ? val[j] - last[j] : last[j] - val[j];
-                last[j] = val[j];
-            }
-        }
-        is_pak64 = (sum[0] > sum[1]);
-        printf("Detected %s PAK format\n\n", is_pak64 ? "A18/64-bit" : "A17/32-bit");
-
-        // Store the data we'll need to reconstruct the archibe to a JSON file
-        json = json_value_init_object();
-        json_object_set_string(json_object(json), "name", change_extension(basename(argv[argc - 1]), ".pak"));
-        json_object_set_number(json_object(json), "version", hdr.version);
-        json_object_set_number(json_object(json), "header_size", hdr.header_size);
-        json_object_set_number(json_object(json), "flags", hdr.flags);
-        json_object_set_number(json_object(json), "nb_files", hdr.nb_files);
-        json_object_set_boolean(json_object(json), "64-bit", is_pak64);
-
-        uint64_t file_data_offset = sizeof(pak_header) +
-            (uint64_t)hdr.nb_files * (is_pak64 ? sizeof(pak_entry64) : sizeof(pak_entry32));
-        JSON_Value* json_files_array = json_value_init_array();
-        printf("OFFSET    SIZE     NAME\n");
-        for (uint32_t i = 0; i < hdr.nb_files; i++) {
-            int j;
-            for (j = 0; (j < 20) && (entry(i, key)[j] == 0); j++);
-            bool skip_decode = (j >= 20);
-            if (!skip_decode)
-                decode((uint8_t*)entry(i, filename), entry(i, key), 128);
-            for (size_t n = 0; n < strlen(entry(i, filename)); n++) {
-                if (entry(i, filename)[n] == '\\')
-                    entry(i, filename)[n] = PATH_SEP;
-            }
-            printf("%09" PRIx64 " %08x %s%c\n", entry(i, data_offset) + file_data_offset,
-                entry(i, size), entry(i, filename), skip_decode ? '*' : ' ');
-            if (list_only)
-                continue;
-            JSON_Value* json_file = json_value_init_object();
-            json_object_set_string(json_object(json_file), "name", entry(i, filename));
-            json_object_set_string(json_object(json_file), "key", key_to_string(entry(i, key)));
-            uint64_t flags = (is_pak64) ? getbe64(&entries64[i].flags) : getbe32(&entries32[i].flags);
-            if (flags != 0)
-                json_object_set_number(json_object(json_file), "flags", (double)flags);
-            json_array_append_value(json_array(json_files_array), json_file);
-            strcpy(path, &entry(i, filename)[1]);
-            for (size_t n = strlen(path); n > 0; n--) {
-                if (path[n] == PATH_SEP) {
-                    path[n] = 0;
-                    break;
-                }
-            }
-            if (!create_path(path)) {
-                fprintf(stderr, "ERROR: Can't create path '%s'\n", path);
-                goto out;
-            }
-            fseek64(file, entry(i, data_offset) + file_data_offset, SEEK_SET);
-            buf = malloc(entry(i, size));
-            if (buf == NULL) {
-                fprintf(stderr, "ERROR: Can't allocate entries\n");
-                goto out;
-            }
-            if (fread(buf, 1, entry(i, size), file) != entry(i, size)) {
-                fprintf(stderr, "ERROR: Can't read archive\n");
+        if (old_pak != NULL) {
+            pak_close(old_pak);
+            old_pak = NULL;
+            create_backup(pak_name);
+            remove(pak_name);
+            if (rename(tmp_path, pak_name) != 0) {
+                fprintf(stderr, "ERROR: Can't rename '%s' to '%s'\n", tmp_path, pak_name);
                 goto out;
             }
-            if (!skip_decode)
-                decode(buf, entry(i, key), entry(i, size));
-            if (!write_file(buf, entry(i, size), &entry(i, filename)[1], false))
-                goto out;
-            free(buf);
-            buf = NULL;
+            printf("\nReused %u/%u unmodified entries\n", nb_reused, hdr.nb_files);
         }
+        if (dedup)
+            printf("\nDeduplicated %u/%u entries, saving %" PRIu64 " bytes\n", nb_dups, hdr.nb_files, dup_size);
 
-        if (!list_only) {
-            json_object_set_value(json_object(json), "files", json_files_array);
-            json_serialize_to_file_pretty(json, change_extension(argv[argc - 1], ".json"));
+        if (incremental) {
+            // Sync the .json with the new archive
+            if (!write_manifest(argv[argc - 1], pak_name, pak_name, &hdr, entries64, is_pak64, true,
+                ctx.mtimes, ctx.hashes))
+                goto out;
         }
         r = 0;
+    } else {
+        r = extract_archive(argv[argc - 1], &opts);
     }
 
 out:
-    json_value_free(json);
-    free(buf);
+    manifest_close(&reader);
+    free(opts.includes);
+    free(opts.excludes);
+    free(opts.names);
+    free(selected);
+    free(dup_slots);
     free(entries64);
+    free(ctx.order);
+    free(ctx.hashes);
+    free(ctx.mtimes);
+    free(ctx.reuse_offsets);
+    if (ctx.use_direct)
+        close_direct(ctx.direct);
+    if (ctx.paths != NULL) {
+        for (uint32_t i = 0; i < hdr.nb_files; i++)
+            free(ctx.paths[i]);
+        free(ctx.paths);
+    }
+    pak_close(old_pak);
+    if (pak_paths != NULL) {
+        for (uint32_t j = 0; j < nb_paks; j++)
+            free(pak_paths[j]);
+        free(pak_paths);
+    }
     if (file != NULL)
         fclose(file);
+    if (tmp_path[0] != 0)
+        remove(tmp_path);
 
-    if (r != 0) {
+    if ((r != 0) && !no_pause) {
         fflush(stdin);
         printf("\nPress any key to continue...");
         (void)getchar();
@@ -0,0 +1,548 @@
+/*
+  Streaming JSON manifests for Gust (Koei/Tecmo) PAK archives
+  Copyright © 2019-2020 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "utf8.h"
+#include "util.h"
+#include "manifest.h"
+
+#define MANIFEST_BUFFER_SIZE    (64 * 1024)
+#define MAX_NESTING             32
+
+//
+// Writer
+//
+
+bool manifest_create(manifest_writer* w, const char* path)
+{
+    memset(w, 0, sizeof(manifest_writer));
+    if (path == NULL) {
+        w->file = stdout;
+        return true;
+    }
+    w->file = fopen_utf8(path, "w");
+    if (w->file == NULL) {
+        fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
+        return false;
+    }
+    setvbuf(w->file, NULL, _IOFBF, MANIFEST_BUFFER_SIZE);
+    return true;
+}
+
+bool manifest_finish(manifest_writer* w)
+{
+    if (w->file == NULL)
+        return false;
+    bool r = !ferror(w->file);
+    if (w->file == stdout) {
+        fputc('\n', w->file);
+        r = (fflush(w->file) == 0) && r;
+    } else {
+        r = (fclose(w->file) == 0) && r;
+    }
+    w->file = NULL;
+    return r;
+}
+
+static void write_string(FILE* file, const char* str)
+{
+    fputc('"', file);
+    for (; *str != 0; str++) {
+        const unsigned char c = (unsigned char)*str;
+        switch (c) {
+        case '"': fputs("\\\"", file); break;
+        case '\\': fputs("\\\\", file); break;
+        case '/': fputs("\\/", file); break;
+        case '\b': fputs("\\b", file); break;
+        case '\f': fputs("\\f", file); break;
+        case '\n': fputs("\\n", file); break;
+        case '\r': fputs("\\r", file); break;
+        case '\t': fputs("\\t", file); break;
+        default:
+            if (c < 0x20)
+                fprintf(file, "\\u%04x", c);
+            else
+                fputc(c, file);
+            break;
+        }
+    }
+    fputc('"', file);
+}
+
+// Separate the new value from the previous one, and write its key if any
+static void begin_value(manifest_writer* w, const char* key)
+{
+    if (w->level > 0) {
+        fputs((w->nonempty & (1U << w->level)) ? ",\n" : "\n", w->file);
+        w->nonempty |= 1U << w->level;
+        for (uint32_t i = 0; i < w->level; i++)
+            fputs("    ", w->file);
+    }
+    if (key != NULL) {
+        write_string(w->file, key);
+        fputs(": ", w->file);
+    }
+}
+
+static void begin_container(manifest_writer* w, const char* key, char c)
+{
+    begin_value(w, key);
+    fputc(c, w->file);
+    w->level++;
+    w->nonempty &= ~(1U << w->level);
+}
+
+static void end_container(manifest_writer* w, char c)
+{
+    if (w->nonempty & (1U << w->level)) {
+        fputc('\n', w->file);
+        for (uint32_t i = 1; i < w->level; i++)
+            fputs("    ", w->file);
+    }
+    w->level--;
+    fputc(c, w->file);
+}
+
+void manifest_begin_object(manifest_writer* w, const char* key)
+{
+    begin_container(w, key, '{');
+}
+
+void manifest_end_object(manifest_writer* w)
+{
+    end_container(w, '}');
+}
+
+void manifest_begin_array(manifest_writer* w, const char* key)
+{
+    begin_container(w, key, '[');
+}
+
+void manifest_end_array(manifest_writer* w)
+{
+    end_container(w, ']');
+}
+
+void manifest_write_string(manifest_writer* w, const char* key, const char* value)
+{
+    begin_value(w, key);
+    write_string(w->file, value);
+}
+
+void manifest_write_number(manifest_writer* w, const char* key, uint64_t value)
+{
+    begin_value(w, key);
+    fprintf(w->file, "0x%" PRIx64, value);
+}
+
+void manifest_write_boolean(manifest_writer* w, const char* key, bool value)
+{
+    begin_value(w, key);
+    fputs(value ? "true" : "false", w->file);
+}
+
+//
+// Reader
+//
+
+// Return the next significant character, without consuming it. Comments are
+// skipped, for compatibility with json_parse_file_with_comments().
+static int peek_char(manifest_reader* r)
+{
+    int c;
+    while ((c = fgetc(r->file)) != EOF) {
+        if ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n'))
+            continue;
+        if (c != '/')
+            break;
+        c = fgetc(r->file);
+        if (c == '/') {
+            while (((c = fgetc(r->file)) != EOF) && (c != '\n'));
+        } else if (c == '*') {
+            int prev = 0;
+            while (((c = fgetc(r->file)) != EOF) && !((prev == '*') && (c == '/')))
+                prev = c;
+        } else {
+            return EOF;
+        }
+        if (c == EOF)
+            return EOF;
+    }
+    if (c != EOF)
+        ungetc(c, r->file);
+    return c;
+}
+
+static bool expect_char(manifest_reader* r, int expected)
+{
+    if (peek_char(r) != expected)
+        return false;
+    fgetc(r->file);
+    return true;
+}
+
+static uint32_t read_hex4(manifest_reader* r)
+{
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = fgetc(r->file);
+        if ((c >= '0') && (c <= '9'))
+            v = (v << 4) | (c - '0');
+        else if ((c >= 'a') && (c <= 'f'))
+            v = (v << 4) | (c - 'a' + 10);
+        else if ((c >= 'A') && (c <= 'F'))
+            v = (v << 4) | (c - 'A' + 10);
+        else
+            return UINT32_MAX;
+    }
+    return v;
+}
+
+// Read a string into buf, truncating it if it doesn't fit.
+// buf may be NULL to skip the string altogether.
+// Strings that don't fit in buf are an error, unless truncate is set
+static bool read_string(manifest_reader* r, char* buf, size_t size, bool truncate)
+{
+    size_t len = 0;
+    char utf8[4];
+    int c;
+
+    if (!expect_char(r, '"'))
+        return false;
+    while ((c = fgetc(r->file)) != '"') {
+        size_t n = 1;
+        if ((c == EOF) || (c < 0x20))
+            return false;
+        utf8[0] = (char)c;
+        if (c == '\\') {
+            switch (c = fgetc(r->file)) {
+            case '"': case '\\': case '/': utf8[0] = (char)c; break;
+            case 'b': utf8[0] = '\b'; break;
+            case 'f': utf8[0] = '\f'; break;
+            case 'n': utf8[0] = '\n'; break;
+            case 'r': utf8[0] = '\r'; break;
+            case 't': utf8[0] = '\t'; break;
+            case 'u': {
+                uint32_t cp = read_hex4(r);
+                if (cp == UINT32_MAX)
+                    return false;
+                if ((cp >= 0xd800) && (cp < 0xdc00)) {
+                    // Surrogate pair
+                    if ((fgetc(r->file) != '\\') || (fgetc(r->file) != 'u'))
+                        return false;
+                    uint32_t lo = read_hex4(r);
+                    if ((lo < 0xdc00) || (lo > 0xdfff))
+                        return false;
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                }
+                if (cp < 0x80) {
+                    utf8[0] = (char)cp;
+                } else if (cp < 0x800) {
+                    utf8[0] = (char)(0xc0 | (cp >> 6));
+                    utf8[1] = (char)(0x80 | (cp & 0x3f));
+                    n = 2;
+                } else if (cp < 0x10000) {
+                    utf8[0] = (char)(0xe0 | (cp >> 12));
+                    utf8[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+                    utf8[2] = (char)(0x80 | (cp & 0x3f));
+                    n = 3;
+                } else {
+                    utf8[0] = (char)(0xf0 | (cp >> 18));
+                    utf8[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+                    utf8[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+                    utf8[3] = (char)(0x80 | (cp & 0x3f));
+                    n = 4;
+                }
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        if ((buf != NULL) && (len + n < size)) {
+            memcpy(&buf[len], utf8, n);
+            len += n;
+        } else if ((buf != NULL) && !truncate) {
+            return false;
+        }
+    }
+    if (buf != NULL)
+        buf[len] = 0;
+    return true;
+}
+
+// Numbers are written in hexadecimal, but we also accept decimal ones, as
+// produced by other JSON tools. Negative values are returned as two's complement.
+static bool read_number(manifest_reader* r, uint64_t* value)
+{
+    char buf[64];
+    size_t len = 0;
+    int c;
+
+    peek_char(r);
+    while ((c = fgetc(r->file)) != EOF) {
+        if (!(((c >= '0') && (c <= '9')) || ((c >= 'a') && (c <= 'f')) || ((c >= 'A') && (c <= 'F')) ||
+            (c == 'x') || (c == 'X') || (c == '-') || (c == '+') || (c == '.'))) {
+            ungetc(c, r->file);
+            break;
+        }
+        if (len >= sizeof(buf) - 1)
+            return false;
+        buf[len++] = (char)c;
+    }
+    buf[len] = 0;
+    if (len == 0)
+        return false;
+    char* end;
+    if ((buf[0] == '0') && ((buf[1] == 'x') || (buf[1] == 'X'))) {
+        *value = strtoull(&buf[2], &end, 16);
+    } else {
+        double d = strtod(buf, &end);
+        *value = (d < 0) ? (uint64_t)(int64_t)d : (uint64_t)d;
+    }
+    return (*end == 0);
+}
+
+static bool read_literal(manifest_reader* r, const char* literal)
+{
+    peek_char(r);
+    for (; *literal != 0; literal++) {
+        if (fgetc(r->file) != *literal)
+            return false;
+    }
+    return true;
+}
+
+static bool read_boolean(manifest_reader* r, bool* value)
+{
+    *value = (peek_char(r) == 't');
+    return read_literal(r, *value ? "true" : "false");
+}
+
+// Advance to the next member of the current object, reading its key. Returns 1
+// if there is a member, 0 at the end of the object or -1 on error.
+static int next_member(manifest_reader* r, char* key, size_t key_size, bool* first)
+{
+    int c = peek_char(r);
+    if (c == '}') {
+        fgetc(r->file);
+        return 0;
+    }
+    if (!*first && !expect_char(r, ','))
+        return -1;
+    *first = false;
+    // A key that doesn't fit can't be one we know of, and its value gets skipped
+    if (!read_string(r, key, key_size, true) || !expect_char(r, ':'))
+        return -1;
+    return 1;
+}
+
+static bool skip_value(manifest_reader* r, uint32_t depth)
+{
+    uint64_t number;
+    bool first = true;
+    char key[2];
+    int n = -1;
+
+    if (depth > MAX_NESTING)
+        return false;
+    switch (peek_char(r)) {
+    case '"':
+        return read_string(r, NULL, 0, false);
+    case 't':
+        return read_literal(r, "true");
+    case 'f':
+        return read_literal(r, "false");
+    case 'n':
+        return read_literal(r, "null");
+    case '{':
+        fgetc(r->file);
+        while ((n = next_member(r, key, sizeof(key), &first)) == 1) {
+            if (!skip_value(r, depth + 1))
+                return false;
+        }
+        return (n == 0);
+    case '[':
+        fgetc(r->file);
+        if (expect_char(r, ']'))
+            return true;
+        do {
+            if (!skip_value(r, depth + 1))
+                return false;
+        } while (expect_char(r, ','));
+        return expect_char(r, ']');
+    default:
+        return read_number(r, &number);
+    }
+}
+
+// Header members, which we must have seen before we can process the entries
+// without going through the file twice.
+#define HAS_NAME            0x01
+#define HAS_VERSION         0x02
+#define HAS_HEADER_SIZE     0x04
+#define HAS_FLAGS           0x08
+#define HAS_NB_FILES        0x10
+#define HAS_64_BIT          0x20
+#define HAS_ARCHIVE_SIZE    0x40
+#define HAS_ARCHIVE_MTIME   0x80
+#define HAS_TIMESTAMP       0x100
+#define HAS_ALL             0x1ff
+
+bool manifest_open(manifest_reader* r, const char* path, manifest_header* hdr)
+{
+    char key[32];
+    uint64_t v;
+    int64_t files_pos = -1;
+    uint32_t seen = 0;
+    bool first = true, ok = true;
+    int n = -1;
+
+    memset(r, 0, sizeof(manifest_reader));
+    memset(hdr, 0, sizeof(manifest_header));
+    r->path = path;
+    r->first = true;
+    r->file = fopen_utf8(path, "rb");
+    if (r->file == NULL) {
+        fprintf(stderr, "ERROR: Can't open '%s'\n", path);
+        return false;
+    }
+    setvbuf(r->file, NULL, _IOFBF, MANIFEST_BUFFER_SIZE);
+    if (!expect_char(r, '{'))
+        goto error;
+    while (ok && ((n = next_member(r, key, sizeof(key), &first)) == 1)) {
+        if (strcmp(key, "files") == 0) {
+            if (peek_char(r) != '[')
+                goto error;
+            files_pos = ftell64(r->file);
+            // Usual case: the header is complete, so we can stream the entries right away
+            if (seen == HAS_ALL) {
+                fgetc(r->file);
+                return true;
+            }
+            ok = skip_value(r, 0);
+        } else if (strcmp(key, "name") == 0) {
+            ok = read_string(r, hdr->name, sizeof(hdr->name), false);
+            seen |= HAS_NAME;
+        } else if (strcmp(key, "64-bit") == 0) {
+            ok = read_boolean(r, &hdr->is_pak64);
+            seen |= HAS_64_BIT;
+        } else if ((strcmp(key, "version") == 0) || (strcmp(key, "header_size") == 0) ||
+            (strcmp(key, "flags") == 0) || (strcmp(key, "nb_files") == 0) ||
+            (strcmp(key, "archive_size") == 0) || (strcmp(key, "archive_mtime") == 0) ||
+            (strcmp(key, "timestamp") == 0)) {
+            ok = read_number(r, &v);
+            if (strcmp(key, "version") == 0) {
+                hdr->version = (uint32_t)v;
+                seen |= HAS_VERSION;
+            } else if (strcmp(key, "header_size") == 0) {
+                hdr->header_size = (uint32_t)v;
+                seen |= HAS_HEADER_SIZE;
+            } else if (strcmp(key, "flags") == 0) {
+                hdr->flags = (uint32_t)v;
+                seen |= HAS_FLAGS;
+            } else if (strcmp(key, "nb_files") == 0) {
+                hdr->nb_files = (uint32_t)v;
+                seen |= HAS_NB_FILES;
+            } else if (strcmp(key, "archive_size") == 0) {
+                hdr->archive_size = v;
+                seen |= HAS_ARCHIVE_SIZE;
+            } else if (strcmp(key, "archive_mtime") == 0) {
+                hdr->archive_mtime = (int64_t)v;
+                seen |= HAS_ARCHIVE_MTIME;
+            } else {
+                hdr->timestamp = (int64_t)v;
+                seen |= HAS_TIMESTAMP;
+            }
+        } else {
+            ok = skip_value(r, 0);
+        }
+    }
+    if (!ok || (n < 0))
+        goto error;
+    if (files_pos < 0) {
+        // No entries
+        r->done = true;
+        return true;
+    }
+    // Go back to the entries, now that we have the whole header
+    if ((fseek64(r->file, files_pos, SEEK_SET) != 0) || !expect_char(r, '['))
+        goto error;
+    return true;
+
+error:
+    fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", path);
+    manifest_close(r);
+    return false;
+}
+
+int manifest_read_entry(manifest_reader* r, manifest_entry* e)
+{
+    char key[16];
+    bool first = true, ok = true;
+    uint64_t v;
+    int n = -1;
+
+    if (r->done)
+        return 0;
+    memset(e, 0, sizeof(manifest_entry));
+    if (expect_char(r, ']')) {
+        r->done = true;
+        return 0;
+    }
+    if ((!r->first && !expect_char(r, ',')) || !expect_char(r, '{'))
+        goto error;
+    r->first = false;
+    while (ok && ((n = next_member(r, key, sizeof(key), &first)) == 1)) {
+        if (strcmp(key, "name") == 0) {
+            ok = read_string(r, e->name, sizeof(e->name), false);
+        } else if (strcmp(key, "key") == 0) {
+            ok = read_string(r, e->key, sizeof(e->key), false);
+        } else if (strcmp(key, "hash") == 0) {
+            ok = read_string(r, e->hash, sizeof(e->hash), false);
+        } else if (strcmp(key, "flags") == 0) {
+            ok = read_number(r, &e->flags);
+        } else if (strcmp(key, "size") == 0) {
+            ok = read_number(r, &e->size);
+        } else if (strcmp(key, "mtime") == 0) {
+            ok = read_number(r, &v);
+            e->mtime = (int64_t)v;
+        } else {
+            ok = skip_value(r, 0);
+        }
+    }
+    if (ok && (n == 0))
+        return 1;
+
+error:
+    fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", r->path);
+    r->done = true;
+    return -1;
+}
+
+void manifest_close(manifest_reader* r)
+{
+    if (r->file != NULL)
+        fclose(r->file);
+    r->file = NULL;
+}
@@ -0,0 +1,80 @@
+/*
+  Streaming JSON manifests for Gust (Koei/Tecmo) PAK archives
+  Copyright © 2019-2020 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#pragma once
+
+// Writes JSON as it goes, in the same layout as parson's pretty serialization
+// (4 space indentation, escaped slashes and hexadecimal numbers), so that the
+// output is identical to what a DOM would have produced, without building one.
+typedef struct {
+    FILE* file;
+    uint32_t level;
+    uint32_t nonempty;      // Bit n is set if the container at level n has values
+} manifest_writer;
+
+// If path is NULL, the JSON data is written to stdout
+bool manifest_create(manifest_writer* w, const char* path);
+bool manifest_finish(manifest_writer* w);
+// key must be NULL for array elements and for the root object
+void manifest_begin_object(manifest_writer* w, const char* key);
+void manifest_end_object(manifest_writer* w);
+void manifest_begin_array(manifest_writer* w, const char* key);
+void manifest_end_array(manifest_writer* w);
+void manifest_write_string(manifest_writer* w, const char* key, const char* value);
+void manifest_write_number(manifest_writer* w, const char* key, uint64_t value);
+void manifest_write_boolean(manifest_writer* w, const char* key, bool value);
+
+// The archive properties from a manifest
+typedef struct {
+    char name[256];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t flags;
+    uint32_t nb_files;
+    bool is_pak64;
+    uint64_t archive_size;
+    int64_t archive_mtime;
+    int64_t timestamp;      // When the mtimes of the entries were recorded
+} manifest_header;
+
+// An element of the "files" array. Missing strings are empty and missing numbers are 0.
+typedef struct {
+    char name[256];
+    char key[64];
+    char hash[32];
+    uint64_t flags;
+    uint64_t size;
+    int64_t mtime;
+} manifest_entry;
+
+// Reads a manifest one entry at a time, without building a DOM.
+typedef struct {
+    FILE* file;
+    const char* path;
+    bool first;             // No entry has been read yet
+    bool done;              // The end of the "files" array has been reached
+} manifest_reader;
+
+bool manifest_open(manifest_reader* r, const char* path, manifest_header* hdr);
+// Returns 1 if an entry was read, 0 at the end of the entries or -1 on error
+int manifest_read_entry(manifest_reader* r, manifest_entry* e);
+void manifest_close(manifest_reader* r);
@@ -0,0 +1,652 @@
+/*
+  Gust (Koei/Tecmo) PAK archive access
+  Copyright © 2019-2020 VitaSmith
+  Copyright © 2018 Yuri Hime (shizukachan)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "utf8.h"
+#include "util.h"
+#include "pak_internal.h"
+#include "thread.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define XOR_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define XOR_TARGET(t)
+#else
+#define XOR_TARGET(t) __attribute__((target(t)))
+#endif
+#endif
+
+// The key is expanded into a repeating pattern whose size is a multiple of both
+// the key size and the SIMD register width, so that the XOR can be applied one
+// register at a time without any modulo: 80 bytes (LCM of 20 and 16) for SSE2
+// and 160 bytes (LCM of 20 and 32) for AVX2.
+#define PATTERN_SIZE        160
+
+typedef void (*xor_fn)(uint8_t* dst, const uint8_t* src, const uint8_t* pattern, size_t nb_blocks);
+
+static void xor_scalar(uint8_t* dst, const uint8_t* src, const uint8_t* pattern, size_t nb_blocks)
+{
+    uint64_t v, p;
+    for (size_t i = 0; i < nb_blocks; i++, dst += PATTERN_SIZE, src += PATTERN_SIZE) {
+        for (size_t j = 0; j < PATTERN_SIZE; j += sizeof(uint64_t)) {
+            memcpy(&v, &src[j], sizeof(v));
+            memcpy(&p, &pattern[j], sizeof(p));
+            v ^= p;
+            memcpy(&dst[j], &v, sizeof(v));
+        }
+    }
+}
+
+#if defined(XOR_X86)
+XOR_TARGET("sse2") static void xor_sse2(uint8_t* dst, const uint8_t* src, const uint8_t* pattern, size_t nb_blocks)
+{
+    __m128i p[PATTERN_SIZE / 32];
+    for (size_t j = 0; j < array_size(p); j++)
+        p[j] = _mm_loadu_si128((const __m128i*)&pattern[16 * j]);
+    // Two passes of the 80-byte pattern per block
+    for (size_t i = 0; i < 2 * nb_blocks; i++, dst += PATTERN_SIZE / 2, src += PATTERN_SIZE / 2) {
+        for (size_t j = 0; j < array_size(p); j++)
+            _mm_storeu_si128((__m128i*)&dst[16 * j],
+                _mm_xor_si128(_mm_loadu_si128((const __m128i*)&src[16 * j]), p[j]));
+    }
+}
+
+XOR_TARGET("avx2") static void xor_avx2(uint8_t* dst, const uint8_t* src, const uint8_t* pattern, size_t nb_blocks)
+{
+    __m256i p[PATTERN_SIZE / 32];
+    for (size_t j = 0; j < array_size(p); j++)
+        p[j] = _mm256_loadu_si256((const __m256i*)&pattern[32 * j]);
+    for (size_t i = 0; i < nb_blocks; i++, dst += PATTERN_SIZE, src += PATTERN_SIZE) {
+        for (size_t j = 0; j < array_size(p); j++)
+            _mm256_storeu_si256((__m256i*)&dst[32 * j],
+                _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&src[32 * j]), p[j]));
+    }
+}
+
+static bool cpu_has_avx2(void)
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    // Check that the OS saves the YMM registers
+    if (!(info[2] & (1 << 27)) || ((_xgetbv(0) & 6) != 6))
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static bool cpu_has_sse2(void)
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+#endif
+
+static xor_fn xor_blocks = xor_scalar;
+static thread_once_t xor_once = THREAD_ONCE_INIT;
+
+static void select_xor(void)
+{
+#if defined(XOR_X86)
+    if (cpu_has_avx2())
+        xor_blocks = xor_avx2;
+    else if (cpu_has_sse2())
+        xor_blocks = xor_sse2;
+#endif
+}
+
+// XOR size bytes from src with key k into dst, where pos is the position of src
+// in the entry, so that an entry can be processed in chunks. src and dst may be
+// the same.
+void pak_decode(uint8_t* dst, const uint8_t* src, const uint8_t* k, uint32_t size, uint32_t pos)
+{
+    uint8_t pattern[PATTERN_SIZE];
+
+    thread_once(&xor_once, select_xor);
+    for (uint32_t i = 0; i < PATTERN_SIZE; i++)
+        pattern[i] = k[(i + pos) % PAK_KEY_SIZE];
+    xor_blocks(dst, src, pattern, size / PATTERN_SIZE);
+    dst += size - size % PATTERN_SIZE;
+    src += size - size % PATTERN_SIZE;
+    for (uint32_t i = 0; i < size % PATTERN_SIZE; i++)
+        dst[i] = src[i] ^ pattern[i];
+}
+
+static force_inline void decode_names(const bool is_pak64, pak_entry64* entries64, uint32_t nb_entries)
+{
+    for (uint32_t i = 0; i < nb_entries; i++) {
+        char* name = entry(i, filename);
+        if (!pak_is_zero_key(entry(i, key)))
+            pak_decode((uint8_t*)name, (uint8_t*)name, entry(i, key), 128, 0);
+        for (size_t n = 0; name[n] != 0; n++) {
+            if (name[n] == '\\')
+                name[n] = PATH_SEP;
+        }
+    }
+}
+
+// Read and validate the header and table of a PAK archive, detect whether the
+// table uses 32 or 64-bit entries and decode all the filenames.
+pak_entry64* pak_read_table(FILE* file, pak_header* hdr, bool* is_pak64_out)
+{
+    pak_entry64* entries64 = NULL;
+    bool is_pak64;
+    size_t len;
+
+    fseek64(file, 0, SEEK_SET);
+    if (fread(hdr, sizeof(pak_header), 1, file) != 1) {
+        fprintf(stderr, "ERROR: Can't read hdr");
+        return NULL;
+    }
+
+    if ((hdr->version != 0x20000) || (hdr->header_size != sizeof(pak_header))) {
+        fprintf(stderr, "ERROR: Signature doesn't match expected PAK file format.\n");
+        return NULL;
+    }
+    if (hdr->nb_files > 16384) {
+        fprintf(stderr, "ERROR: Too many entries.\n");
+        return NULL;
+    }
+
+    entries64 = calloc(hdr->nb_files, sizeof(pak_entry64));
+    if (entries64 == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate entries\n");
+        return NULL;
+    }
+
+    // Only read what a table of 32-bit entries, the smallest one, needs, along with
+    // the first 64-bit entries for the detection below, if they extend further.
+    // The rest of a table of 64-bit entries is read once we know that's what it is.
+    const size_t size32 = (size_t)hdr->nb_files * sizeof(pak_entry32);
+    const size_t size64 = (size_t)hdr->nb_files * sizeof(pak_entry64);
+    len = fread(entries64, 1, max(size32, min(hdr->nb_files, 64) * sizeof(pak_entry64)), file);
+    if (len < size32) {
+        fprintf(stderr, "ERROR: Can't read PAK hdr\n");
+        free(entries64);
+        return NULL;
+    }
+
+    // Detect if we are dealing with 32 or 64-bit pak entries by checking
+    // the data_offsets at the expected 32 and 64-bit struct location and
+    // adding the absolute value of the difference with last data_offset.
+    // The sum that is closest to zero tells us if we are dealing with a
+    // 32 or 64-bit PAK archive. If the file is too short for the first 64-bit
+    // entries, it can only be a 32-bit one.
+    uint64_t sum[2] = { 0, 0 };
+    uint32_t val[2], last[2] = { 0, 0 };
+    for (uint32_t i = 0; i < min(hdr->nb_files, 64); i++) {
+        val[0] = ((pak_entry32*)entries64)[i].data_offset;
+        val[1] = (uint32_t)(entries64[i].data_offset >> 32);
+        for (int j = 0; j < 2; j++) {
+            sum[j] += (val[j] > last[j]) ? val[j] - last[j] : last[j] - val[j];
+            last[j] = val[j];
+        }
+    }
+    is_pak64 = (sum[0] > sum[1]) && (len >= min(hdr->nb_files, 64) * sizeof(pak_entry64));
+
+    if (is_pak64 && (len < size64) &&
+        (fread((uint8_t*)entries64 + len, 1, size64 - len, file) != size64 - len)) {
+        fprintf(stderr, "ERROR: Can't read PAK hdr\n");
+        free(entries64);
+        return NULL;
+    }
+    pak_specialize(is_pak64, decode_names, entries64, hdr->nb_files);
+
+    *is_pak64_out = is_pak64;
+    return entries64;
+}
+
+// Entry names are compared regardless of the type of path separators used, or the
+// presence of a leading separator, so that users can specify them any way they like.
+static __inline const char* skip_separators(const char* name)
+{
+    while ((*name == '\\') || (*name == '/'))
+        name++;
+    return name;
+}
+
+static __inline char normalize_char(char c)
+{
+    return (c == '\\') ? '/' : c;
+}
+
+bool pak_is_same_name(const char* entry_name, const char* name)
+{
+    entry_name = skip_separators(entry_name);
+    name = skip_separators(name);
+    for (; (*entry_name != 0) && (*name != 0); entry_name++, name++) {
+        if (normalize_char(*entry_name) != normalize_char(*name))
+            return false;
+    }
+    return (*entry_name == *name);
+}
+
+// FNV-1a hash of a normalized name
+static uint64_t name_hash(const char* name)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (name = skip_separators(name); *name != 0; name++) {
+        h ^= (uint8_t)normalize_char(*name);
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Match a name against a glob pattern, where '*' matches any sequence of characters,
+// including path separators, and '?' matches any single character.
+bool pak_match_glob(const char* pattern, const char* name)
+{
+    const char *p = skip_separators(pattern), *n = skip_separators(name);
+    const char *star = NULL, *backtrack = NULL;
+
+    while (*n != 0) {
+        if (*p == '*') {
+            star = ++p;
+            backtrack = n;
+        } else if ((*p != 0) && ((*p == '?') || (normalize_char(*p) == normalize_char(*n)))) {
+            p++;
+            n++;
+        } else if (star != NULL) {
+            p = star;
+            n = ++backtrack;
+        } else {
+            return false;
+        }
+    }
+    while (*p == '*')
+        p++;
+    return (*p == 0);
+}
+
+static force_inline void fill_index(const bool is_pak64, pak_index* index, pak_entry64* entries64, uint32_t nb_entries)
+{
+    for (uint32_t i = 0; i < nb_entries; i++) {
+        uint32_t h = (uint32_t)name_hash(entry(i, filename)) & index->mask;
+        while (index->slots[h] != 0)
+            h = (h + 1) & index->mask;
+        index->slots[h] = i + 1;
+    }
+}
+
+static bool build_index(pak_index* index, pak_entry64* entries64, bool is_pak64, uint32_t nb_entries)
+{
+    uint32_t size = 16;
+    while (size < 2 * nb_entries)
+        size <<= 1;
+    index->slots = calloc(size, sizeof(uint32_t));
+    if (index->slots == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate index\n");
+        return false;
+    }
+    index->mask = size - 1;
+    pak_specialize(is_pak64, fill_index, index, entries64, nb_entries);
+    return true;
+}
+
+// Returns the index of the entry or UINT32_MAX if not found
+static uint32_t find_entry(const pak_index* index, pak_entry64* entries64, bool is_pak64, const char* name)
+{
+    for (uint32_t h = (uint32_t)name_hash(name) & index->mask; index->slots[h] != 0; h = (h + 1) & index->mask) {
+        if (pak_is_same_name(entry(index->slots[h] - 1, filename), name))
+            return index->slots[h] - 1;
+    }
+    return UINT32_MAX;
+}
+
+// The .pakidx sidecar caches the decoded table of an archive, along with its name
+// index, so that subsequent listings and lookups don't have to read, decode and
+// analyze the table again. It uses native byte order and is validated against the
+// size, modification time and header of the archive, so that any change to the
+// archive results in the sidecar being recreated.
+#define PAKIDX_MAGIC        "GUSTIDX2"
+
+typedef struct {
+    char     magic[8];
+    uint64_t pak_size;
+    uint64_t pak_mtime;
+    uint64_t header_hash;
+    uint32_t nb_entries;
+    uint32_t is_pak64;
+    uint32_t nb_slots;
+    uint32_t pool_size;
+    // Followed by:
+    // uint64_t data_offset[nb_entries];
+    // uint64_t flags[nb_entries];
+    // uint32_t size[nb_entries];
+    // uint32_t name[nb_entries];           Offset of the name in the string pool
+    // uint8_t  key[nb_entries][PAK_KEY_SIZE];
+    // uint32_t slot[nb_slots];             See pak_index
+    // char     pool[pool_size];
+} pakidx_header;
+
+static char* pakidx_path(const char* pak_path)
+{
+    size_t len = strlen(pak_path);
+    char* path = malloc(len + 8);
+    if (path == NULL)
+        return NULL;
+    bool has_ext = (len >= 4) && (strcmp(&pak_path[len - 4], ".pak") == 0);
+    snprintf(path, len + 8, "%s%s", pak_path, has_ext ? "idx" : ".pakidx");
+    return path;
+}
+
+static bool get_pakidx_key(const char* pak_path, FILE* file, pakidx_header* key)
+{
+    struct stat64 st;
+    pak_header hdr;
+
+    memset(key, 0, sizeof(pakidx_header));
+    if ((stat64_utf8(pak_path, &st) != 0) || !read_at(file, &hdr, sizeof(hdr), 0))
+        return false;
+    memcpy(key->magic, PAKIDX_MAGIC, sizeof(key->magic));
+    key->pak_size = (uint64_t)st.st_size;
+    // An in-place update in the same second can change the table without changing
+    // the size of the archive, so whole seconds aren't enough
+    key->pak_mtime = file_mtime(file);
+    key->header_hash = xxh64(&hdr, sizeof(hdr), 0);
+    return (key->pak_mtime != 0);
+}
+
+// Returns the table of the archive, in the same format as pak_read_table(), if a valid
+// sidecar exists, or NULL otherwise. The table is still rebuilt from the sidecar, which
+// is linear in the number of entries, but without any of the reading, decoding and
+// hashing that pak_read_table() and build_index() need.
+static pak_entry64* load_pakidx(const char* pak_path, FILE* file, pak_header* hdr,
+    bool* is_pak64_out, pak_index* index)
+{
+    pak_entry64* entries64 = NULL;
+    mapped_file m;
+    pakidx_header key;
+    bool is_pak64;
+    char* path = pakidx_path(pak_path);
+
+    init_mapped_file(&m);
+
+    if ((path == NULL) || !is_file(path) || !get_pakidx_key(pak_path, file, &key) || !map_file(path, &m))
+        goto out;
+    const pakidx_header* idx = (const pakidx_header*)m.data;
+    if ((m.size < sizeof(pakidx_header)) || (memcmp(idx, &key, offsetof(pakidx_header, nb_entries)) != 0))
+        goto out;
+    // The sidecar may have been truncated or corrupted, so everything in it must be
+    // validated before use, starting with the sizes of the arrays
+    const uint32_t nb = idx->nb_entries;
+    if ((nb > 16384) || (idx->nb_slots <= nb) || (idx->nb_slots > 4 * 16384) ||
+        !is_power_of_2(idx->nb_slots) || ((idx->pool_size == 0) && (nb != 0)) ||
+        (sizeof(pakidx_header) + (uint64_t)nb * (2 * sizeof(uint64_t) + 2 * sizeof(uint32_t) + PAK_KEY_SIZE) +
+        (uint64_t)idx->nb_slots * sizeof(uint32_t) + idx->pool_size != m.size))
+        goto out;
+    const uint64_t* data_offset = (const uint64_t*)&idx[1];
+    const uint64_t* flags = &data_offset[nb];
+    const uint32_t* size = (const uint32_t*)&flags[nb];
+    const uint32_t* name = &size[nb];
+    const uint8_t* k = (const uint8_t*)&name[nb];
+    const uint32_t* slot = (const uint32_t*)&k[(size_t)nb * PAK_KEY_SIZE];
+    const char* pool = (const char*)&slot[idx->nb_slots];
+    // Names must start in the pool and be terminated there, which the final NUL of
+    // the pool ensures, and the index must have exactly one slot per entry, so that
+    // lookups, which stop at the first empty slot, always terminate
+    if ((idx->pool_size != 0) && (pool[idx->pool_size - 1] != 0))
+        goto out;
+    for (uint32_t i = 0; i < nb; i++) {
+        if (name[i] >= idx->pool_size)
+            goto out;
+    }
+    uint32_t nb_used = 0;
+    for (uint32_t i = 0; i < idx->nb_slots; i++) {
+        if (slot[i] > nb)
+            goto out;
+        if (slot[i] != 0)
+            nb_used++;
+    }
+    if (nb_used != nb)
+        goto out;
+
+    is_pak64 = (idx->is_pak64 != 0);
+    entries64 = calloc(nb, sizeof(pak_entry64));
+    index->slots = malloc(idx->nb_slots * sizeof(uint32_t));
+    if ((entries64 == NULL) || (index->slots == NULL)) {
+        fprintf(stderr, "ERROR: Can't allocate entries\n");
+        free(entries64);
+        entries64 = NULL;
+        free(index->slots);
+        index->slots = NULL;
+        goto out;
+    }
+    memcpy(index->slots, slot, idx->nb_slots * sizeof(uint32_t));
+    index->mask = idx->nb_slots - 1;
+    for (uint32_t i = 0; i < nb; i++) {
+        strncpy(entry(i, filename), &pool[name[i]], sizeof(entries64[i].filename) - 1);
+        for (char* c = entry(i, filename); *c != 0; c++) {
+            if (*c == '\\')
+                *c = PATH_SEP;
+        }
+        set_entry(i, size, size[i]);
+        memcpy(entry(i, key), &k[(size_t)i * PAK_KEY_SIZE], PAK_KEY_SIZE);
+        set_entry(i, data_offset, data_offset[i]);
+        if (is_pak64)
+            setbe64(&entries64[i].flags, flags[i]);
+        else
+            setbe32(&entries32[i].flags, (uint32_t)flags[i]);
+    }
+    read_at(file, hdr, sizeof(pak_header), 0);
+    hdr->nb_files = nb;
+    *is_pak64_out = is_pak64;
+
+out:
+    unmap_file(&m);
+    free(path);
+    return entries64;
+}
+
+// Failing to create the sidecar is not an error, since it is only used as a cache
+static void write_pakidx(const char* pak_path, FILE* file, pak_entry64* entries64, bool is_pak64,
+    uint32_t nb_entries, const pak_index* index)
+{
+    pakidx_header idx;
+    FILE* idx_file = NULL;
+    char* path = pakidx_path(pak_path);
+
+    if ((path == NULL) || !get_pakidx_key(pak_path, file, &idx))
+        goto out;
+    idx.nb_entries = nb_entries;
+    idx.is_pak64 = is_pak64 ? 1 : 0;
+    idx.nb_slots = index->mask + 1;
+    for (uint32_t i = 0; i < nb_entries; i++)
+        idx.pool_size += (uint32_t)strnlen(entry(i, filename), sizeof(entries64[i].filename) - 1) + 1;
+
+    idx_file = fopen_utf8(path, "wb");
+    if (idx_file == NULL) {
+        fprintf(stderr, "WARNING: Can't create index '%s'\n", path);
+        goto out;
+    }
+    fwrite(&idx, sizeof(idx), 1, idx_file);
+    for (uint32_t i = 0; i < nb_entries; i++) {
+        uint64_t data_offset = entry(i, data_offset);
+        fwrite(&data_offset, sizeof(data_offset), 1, idx_file);
+    }
+    for (uint32_t i = 0; i < nb_entries; i++) {
+        uint64_t flags = (is_pak64) ? getbe64(&entries64[i].flags) : getbe32(&entries32[i].flags);
+        fwrite(&flags, sizeof(flags), 1, idx_file);
+    }
+    for (uint32_t i = 0; i < nb_entries; i++) {
+        uint32_t size = entry(i, size);
+        fwrite(&size, sizeof(size), 1, idx_file);
+    }
+    for (uint32_t i = 0, name = 0; i < nb_entries; i++) {
+        fwrite(&name, sizeof(name), 1, idx_file);
+        name += (uint32_t)strnlen(entry(i, filename), sizeof(entries64[i].filename) - 1) + 1;
+    }
+    for (uint32_t i = 0; i < nb_entries; i++)
+        fwrite(entry(i, key), 1, PAK_KEY_SIZE, idx_file);
+    fwrite(index->slots, sizeof(uint32_t), idx.nb_slots, idx_file);
+    for (uint32_t i = 0; i < nb_entries; i++) {
+        size_t len = strnlen(entry(i, filename), sizeof(entries64[i].filename) - 1);
+        fwrite(entry(i, filename), 1, len, idx_file);
+        fputc(0, idx_file);
+    }
+    // A truncated sidecar is rejected on load, so there's no need to remove it
+    if (ferror(idx_file))
+        fprintf(stderr, "WARNING: Can't write index '%s'\n", path);
+
+out:
+    if (idx_file != NULL)
+        fclose(idx_file);
+    free(path);
+}
+
+pak_file* pak_open(const char* path, uint32_t flags)
+{
+    pak_file* pak = calloc(1, sizeof(pak_file));
+    if (pak == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate archive\n");
+        return NULL;
+    }
+    init_mapped_file(&pak->map);
+    pak->file = fopen_utf8(path, "rb");
+    if (pak->file == NULL) {
+        fprintf(stderr, "ERROR: Can't open PAK file '%s'\n", path);
+        goto error;
+    }
+    if (flags & PAK_SIDECAR)
+        pak->entries64 = load_pakidx(path, pak->file, &pak->header, &pak->is_pak64, &pak->index);
+    if (pak->entries64 == NULL) {
+        pak->entries64 = pak_read_table(pak->file, &pak->header, &pak->is_pak64);
+        if ((pak->entries64 == NULL) ||
+            !build_index(&pak->index, pak->entries64, pak->is_pak64, pak->header.nb_files))
+            goto error;
+        if (flags & PAK_SIDECAR)
+            write_pakidx(path, pak->file, pak->entries64, pak->is_pak64, pak->header.nb_files, &pak->index);
+    }
+    pak->data_offset = sizeof(pak_header) +
+        (uint64_t)pak->header.nb_files * (pak->is_pak64 ? sizeof(pak_entry64) : sizeof(pak_entry32));
+    if ((flags & PAK_MAP) && !map_file(path, &pak->map))
+        goto error;
+    return pak;
+
+error:
+    pak_close(pak);
+    return NULL;
+}
+
+void pak_close(pak_file* pak)
+{
+    if (pak == NULL)
+        return;
+    unmap_file(&pak->map);
+    if (pak->file != NULL)
+        fclose(pak->file);
+    free(pak->entries64);
+    free(pak->index.slots);
+    free(pak);
+}
+
+uint32_t pak_count(const pak_file* pak)
+{
+    return pak->header.nb_files;
+}
+
+const char* pak_entry_name(const pak_file* pak, uint32_t i)
+{
+    pak_entry64* entries64 = pak->entries64;
+    const bool is_pak64 = pak->is_pak64;
+    return entry(i, filename);
+}
+
+uint32_t pak_entry_size(const pak_file* pak, uint32_t i)
+{
+    pak_entry64* entries64 = pak->entries64;
+    const bool is_pak64 = pak->is_pak64;
+    return entry(i, size);
+}
+
+// Returns the absolute offset of the data in the archive
+uint64_t pak_entry_offset(const pak_file* pak, uint32_t i)
+{
+    pak_entry64* entries64 = pak->entries64;
+    const bool is_pak64 = pak->is_pak64;
+    return pak->data_offset + entry(i, data_offset);
+}
+
+const uint8_t* pak_entry_key(const pak_file* pak, uint32_t i)
+{
+    pak_entry64* entries64 = pak->entries64;
+    const bool is_pak64 = pak->is_pak64;
+    return entry(i, key);
+}
+
+uint64_t pak_entry_flags(const pak_file* pak, uint32_t i)
+{
+    pak_entry64* entries64 = pak->entries64;
+    return (pak->is_pak64) ? getbe64(&entries64[i].flags) : getbe32(&entries32[i].flags);
+}
+
+uint32_t pak_find(const pak_file* pak, const char* name)
+{
+    return find_entry(&pak->index, pak->entries64, pak->is_pak64, name);
+}
+
+// Read and decode size bytes, starting at offset, from the data of entry i.
+// If the archive is mapped, the data is decoded straight from the mapping.
+bool pak_read(const pak_file* pak, uint32_t i, uint64_t offset, uint32_t size, void* buf)
+{
+    if ((i >= pak->header.nb_files) || (offset + size > pak_entry_size(pak, i)))
+        return false;
+    const uint64_t data_offset = pak_entry_offset(pak, i) + offset;
+    const uint8_t* key = pak_entry_key(pak, i);
+    if ((pak->map.data != NULL) && (data_offset + size <= pak->map.size)) {
+        if (pak_is_zero_key(key))
+            memcpy(buf, &pak->map.data[data_offset], size);
+        else
+            pak_decode(buf, &pak->map.data[data_offset], key, size, (uint32_t)(offset % PAK_KEY_SIZE));
+        return true;
+    }
+    if (!read_at(pak->file, buf, size, data_offset))
+        return false;
+    if (!pak_is_zero_key(key))
+        pak_decode(buf, buf, key, size, (uint32_t)(offset % PAK_KEY_SIZE));
+    return true;
+}
+
+// Returns the data of entry i straight from the archive mapping, if it isn't
+// encrypted and the archive was opened with PAK_MAP, or NULL otherwise.
+const uint8_t* pak_view(const pak_file* pak, uint32_t i)
+{
+    if ((pak->map.data == NULL) || (i >= pak->header.nb_files) || !pak_is_zero_key(pak_entry_key(pak, i)) ||
+        (pak_entry_offset(pak, i) + pak_entry_size(pak, i) > pak->map.size))
+        return NULL;
+    return &pak->map.data[pak_entry_offset(pak, i)];
+}
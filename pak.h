@@ -0,0 +1,88 @@
+/*
+  Gust (Koei/Tecmo) PAK archive access
+  Copyright © 2019-2020 VitaSmith
+  Copyright © 2018 Yuri Hime (shizukachan)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#pragma once
+
+#define PAK_KEY_SIZE        20
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t version;
+    uint32_t nb_files;
+    uint32_t header_size;
+    uint32_t flags;
+} pak_header;
+
+typedef struct {
+    char     filename[128];
+    uint32_t size;
+    uint8_t  key[PAK_KEY_SIZE];
+    uint32_t data_offset;
+    uint32_t flags;
+} pak_entry32;
+
+typedef struct {
+    char     filename[128];
+    uint32_t size;
+    uint8_t  key[PAK_KEY_SIZE];
+    uint64_t data_offset;
+    uint64_t flags;
+} pak_entry64;
+#pragma pack(pop)
+
+static __inline bool pak_is_zero_key(const uint8_t* key)
+{
+    for (int i = 0; i < PAK_KEY_SIZE; i++) {
+        if (key[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+// An opened archive. The pak_*() functions below can be called concurrently
+// from multiple threads on the same archive.
+typedef struct pak_file pak_file;
+
+// pak_open() flags
+#define PAK_MAP             0x01    // Map the archive in memory, for pak_view()
+#define PAK_SIDECAR         0x02    // Use a .pakidx file to cache the decoded table
+
+// Low level functions
+void pak_decode(uint8_t* dst, const uint8_t* src, const uint8_t* key, uint32_t size, uint32_t pos);
+pak_entry64* pak_read_table(FILE* file, pak_header* hdr, bool* is_pak64);
+bool pak_is_same_name(const char* entry_name, const char* name);
+bool pak_match_glob(const char* pattern, const char* name);
+
+// Archive access. Entries are identified by their index in the table, from 0 to
+// pak_count() - 1, and pak_find() returns UINT32_MAX if an entry doesn't exist.
+pak_file* pak_open(const char* path, uint32_t flags);
+void pak_close(pak_file* pak);
+uint32_t pak_count(const pak_file* pak);
+const char* pak_entry_name(const pak_file* pak, uint32_t i);
+uint32_t pak_entry_size(const pak_file* pak, uint32_t i);
+uint64_t pak_entry_offset(const pak_file* pak, uint32_t i);
+const uint8_t* pak_entry_key(const pak_file* pak, uint32_t i);
+uint64_t pak_entry_flags(const pak_file* pak, uint32_t i);
+uint32_t pak_find(const pak_file* pak, const char* name);
+bool pak_read(const pak_file* pak, uint32_t i, uint64_t offset, uint32_t size, void* buf);
+const uint8_t* pak_view(const pak_file* pak, uint32_t i);
@@ -0,0 +1,54 @@
+/*
+  Gust (Koei/Tecmo) PAK archive access - internal definitions
+  Copyright © 2019-2020 VitaSmith
+  Copyright © 2018 Yuri Hime (shizukachan)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util.h"
+#include "pak.h"
+
+#pragma once
+
+// To handle either 32 or 64 bit PAK entries
+#define table_entry(t, i, m) (is_pak64 ? (t)[i].m : ((pak_entry32*)(t))[i].m)
+#define entries32 ((pak_entry32*)entries64)
+#define entry(i, m) table_entry(entries64, i, m)
+#define set_entry(i, m, v) do {if (is_pak64) entries64[i].m = v; else (entries32[i]).m = (uint32_t)(v);} while(0)
+// Call fn(true, ...) for 64-bit entries or fn(false, ...) for 32-bit ones, where fn is a
+// force_inline function whose first parameter is the is_pak64 that entry() uses. This
+// gives fn a copy per layout, instead of testing is_pak64 on every access to a field.
+#define pak_specialize(is_pak64, fn, ...) ((is_pak64) ? fn(true, __VA_ARGS__) : fn(false, __VA_ARGS__))
+
+// Open addressing hash table of the decoded entry names
+typedef struct {
+    uint32_t* slots;    // Entry index + 1, or 0 for an empty slot
+    uint32_t mask;
+} pak_index;
+
+// All the fields are read-only once the archive is opened
+struct pak_file {
+    FILE* file;
+    mapped_file map;            // Only set if opened with PAK_MAP
+    pak_header header;
+    pak_entry64* entries64;     // Actually pak_entry32 if !is_pak64
+    bool is_pak64;
+    uint64_t data_offset;       // Absolute offset of the data of the entries
+    pak_index index;
+};
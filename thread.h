@@ -0,0 +1,123 @@
+/*
+  Thread handling for Gust (Koei/Tecmo) PC games tools
+  Copyright © 2019-2020 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#pragma once
+
+#if defined(_WIN32)
+#include <windows.h>
+
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+// Thread functions must be declared as 'static THREAD_CALL func(void* arg)' and return 0
+#define THREAD_CALL DWORD WINAPI
+typedef DWORD (WINAPI *thread_fn)(void*);
+
+static __inline bool thread_create(thread_t* t, thread_fn fn, void* arg)
+{
+    *t = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return (*t != NULL);
+}
+
+static __inline void thread_join(thread_t t)
+{
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+
+#define mutex_init(m)       InitializeCriticalSection(m)
+#define mutex_lock(m)       EnterCriticalSection(m)
+#define mutex_unlock(m)     LeaveCriticalSection(m)
+#define mutex_destroy(m)    DeleteCriticalSection(m)
+#define cond_init(c)        InitializeConditionVariable(c)
+#define cond_wait(c, m)     SleepConditionVariableCS(c, m, INFINITE)
+#define cond_signal(c)      WakeConditionVariable(c)
+#define cond_broadcast(c)   WakeAllConditionVariable(c)
+#define cond_destroy(c)     do { (void)(c); } while (0)
+
+typedef INIT_ONCE thread_once_t;
+#define THREAD_ONCE_INIT    INIT_ONCE_STATIC_INIT
+
+static BOOL CALLBACK thread_once_call(PINIT_ONCE once, PVOID fn, PVOID* ctx)
+{
+    (void)once; (void)ctx;
+    (*(void (**)(void))fn)();
+    return TRUE;
+}
+
+// Call fn() exactly once, with every other caller waiting until it has returned
+static __inline void thread_once(thread_once_t* once, void (*fn)(void))
+{
+    InitOnceExecuteOnce(once, thread_once_call, &fn, NULL);
+}
+
+static __inline uint32_t cpu_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (uint32_t)info.dwNumberOfProcessors;
+}
+#else
+#include <pthread.h>
+#include <unistd.h>
+
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+// Thread functions must be declared as 'static THREAD_CALL func(void* arg)' and return 0
+#define THREAD_CALL void*
+typedef void* (*thread_fn)(void*);
+
+static __inline bool thread_create(thread_t* t, thread_fn fn, void* arg)
+{
+    return (pthread_create(t, NULL, fn, arg) == 0);
+}
+
+static __inline void thread_join(thread_t t)
+{
+    pthread_join(t, NULL);
+}
+
+#define mutex_init(m)       pthread_mutex_init(m, NULL)
+#define mutex_lock(m)       pthread_mutex_lock(m)
+#define mutex_unlock(m)     pthread_mutex_unlock(m)
+#define mutex_destroy(m)    pthread_mutex_destroy(m)
+#define cond_init(c)        pthread_cond_init(c, NULL)
+#define cond_wait(c, m)     pthread_cond_wait(c, m)
+#define cond_signal(c)      pthread_cond_signal(c)
+#define cond_broadcast(c)   pthread_cond_broadcast(c)
+#define cond_destroy(c)     pthread_cond_destroy(c)
+
+typedef pthread_once_t thread_once_t;
+#define THREAD_ONCE_INIT    PTHREAD_ONCE_INIT
+
+// Call fn() exactly once, with every other caller waiting until it has returned
+static __inline void thread_once(thread_once_t* once, void (*fn)(void))
+{
+    pthread_once(once, fn);
+}
+
+static __inline uint32_t cpu_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (uint32_t)n : 1;
+}
+#endif
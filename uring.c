@@ -0,0 +1,356 @@
+/*
+  io_uring file writer for Gust (Koei/Tecmo) PC games tools
+  Copyright © 2019-2020 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "util.h"
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define USE_URING
+#endif
+#endif
+
+#if defined(USE_URING)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+
+// Maximum number of files in flight, and of bytes waiting to be written
+#define URING_MAX_FILES     64
+#define URING_MAX_BYTES     (32 * 1024 * 1024)
+// Each file uses 4 linked operations: open, write, close and statx
+#define URING_OPS_PER_FILE  4
+#define URING_SUBMIT_BATCH  32
+// The operation is stored in the low bits of the user data of each SQE
+enum { OP_OPEN, OP_WRITE, OP_CLOSE, OP_STATX };
+
+typedef struct {
+    char path[256];
+    uint8_t* buf;
+    uint32_t size;
+    uint32_t pending;       // Operations that haven't completed yet
+    bool failed;
+    int64_t* mtime;
+    struct statx stx;
+} uring_request;
+
+struct uring {
+    int fd;
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    uint32_t *sq_tail, *sq_mask, *sq_array;
+    uint32_t *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe* cqes;
+    uint32_t to_submit;
+    uint32_t nb_inflight;
+    uint32_t nb_free;
+    uint64_t pending_bytes;
+    bool failed;
+    bool probing;           // Don't report errors when checking for io_uring support
+    // The index of a request is also the index of its registered file slot
+    uint32_t free_list[URING_MAX_FILES];
+    uring_request requests[URING_MAX_FILES];
+};
+
+static int sys_io_uring_setup(uint32_t entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, uint32_t opcode, const void* arg, uint32_t nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// The SQ always has room, since each request in flight uses at most URING_OPS_PER_FILE entries
+static struct io_uring_sqe* get_sqe(uring* u, uring_request* req, uint32_t op, uint8_t opcode, uint8_t flags)
+{
+    const uint32_t tail = *u->sq_tail;
+    const uint32_t index = tail & *u->sq_mask;
+    struct io_uring_sqe* sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->user_data = (uint64_t)(uintptr_t)req | op;
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+    return sqe;
+}
+
+static void complete_request(uring* u, uring_request* req)
+{
+    if (req->failed) {
+        if (!u->probing)
+            fprintf(stderr, "ERROR: Can't write file '%s'\n", req->path);
+        u->failed = true;
+    } else if (req->mtime != NULL) {
+        *req->mtime = (int64_t)req->stx.stx_mtime.tv_sec;
+    }
+    free(req->buf);
+    req->buf = NULL;
+    u->pending_bytes -= req->size;
+    u->nb_inflight--;
+    u->free_list[u->nb_free++] = (uint32_t)(req - u->requests);
+}
+
+static void reap_completions(uring* u)
+{
+    uint32_t head = *u->cq_head;
+    const uint32_t tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        const struct io_uring_cqe* cqe = &u->cqes[head & *u->cq_mask];
+        uring_request* req = (uring_request*)(uintptr_t)(cqe->user_data & ~3ULL);
+        // Short writes also break the chain
+        if ((cqe->res < 0) || (((cqe->user_data & 3) == OP_WRITE) && ((uint32_t)cqe->res != req->size)))
+            req->failed = true;
+        if (--req->pending == 0)
+            complete_request(u, req);
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Submit the queued operations, and wait until at least min_complete have completed
+static bool submit(uring* u, uint32_t min_complete)
+{
+    while ((u->to_submit != 0) || (min_complete != 0)) {
+        int r = sys_io_uring_enter(u->fd, u->to_submit, min_complete,
+            (min_complete != 0) ? IORING_ENTER_GETEVENTS : 0);
+        if (r < 0) {
+            if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY)) {
+                reap_completions(u);
+                continue;
+            }
+            fprintf(stderr, "ERROR: io_uring submission failed\n");
+            u->failed = true;
+            return false;
+        }
+        u->to_submit -= min((uint32_t)r, u->to_submit);
+        if (min_complete != 0)
+            break;
+    }
+    reap_completions(u);
+    return true;
+}
+
+static void queue_file(uring* u, uring_request* req, uint32_t slot, uint32_t open_flags)
+{
+    struct io_uring_sqe* sqe = get_sqe(u, req, OP_OPEN, IORING_OP_OPENAT, IOSQE_IO_LINK);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)req->path;
+    sqe->len = 0666;
+    sqe->open_flags = open_flags;
+    sqe->file_index = slot + 1;
+    req->pending = 1;
+    u->nb_inflight++;
+    if (req->buf != NULL) {
+        sqe = get_sqe(u, req, OP_WRITE, IORING_OP_WRITE, IOSQE_IO_LINK | IOSQE_FIXED_FILE);
+        sqe->fd = (int32_t)slot;
+        sqe->addr = (uint64_t)(uintptr_t)req->buf;
+        sqe->len = req->size;
+        req->pending++;
+    }
+    sqe = get_sqe(u, req, OP_CLOSE, IORING_OP_CLOSE, (req->mtime != NULL) ? IOSQE_IO_LINK : 0);
+    sqe->file_index = slot + 1;
+    req->pending++;
+    if (req->mtime != NULL) {
+        sqe = get_sqe(u, req, OP_STATX, IORING_OP_STATX, 0);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)req->path;
+        sqe->len = STATX_MTIME;
+        sqe->off = (uint64_t)(uintptr_t)&req->stx;
+        req->pending++;
+    }
+}
+
+uring* uring_create(void)
+{
+    struct io_uring_params p;
+    int fds[URING_MAX_FILES];
+    uring* u = calloc(1, sizeof(uring));
+    if (u == NULL)
+        return NULL;
+    u->fd = -1;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = sys_io_uring_setup(URING_MAX_FILES * URING_OPS_PER_FILE, &p);
+    if (u->fd < 0)
+        goto fail;
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->sq_size = u->cq_size = max(u->sq_size, u->cq_size);
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+        u->sq_ptr = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ptr = u->sq_ptr;
+    } else {
+        u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED) {
+            u->cq_ptr = NULL;
+            goto fail;
+        }
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+    u->sq_tail = (uint32_t*)((uint8_t*)u->sq_ptr + p.sq_off.tail);
+    u->sq_mask = (uint32_t*)((uint8_t*)u->sq_ptr + p.sq_off.ring_mask);
+    u->sq_array = (uint32_t*)((uint8_t*)u->sq_ptr + p.sq_off.array);
+    u->cq_head = (uint32_t*)((uint8_t*)u->cq_ptr + p.cq_off.head);
+    u->cq_tail = (uint32_t*)((uint8_t*)u->cq_ptr + p.cq_off.tail);
+    u->cq_mask = (uint32_t*)((uint8_t*)u->cq_ptr + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)((uint8_t*)u->cq_ptr + p.cq_off.cqes);
+
+    // Register empty file slots, which the open operations then fill
+    for (uint32_t i = 0; i < URING_MAX_FILES; i++)
+        fds[i] = -1;
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_FILES, fds, URING_MAX_FILES) != 0)
+        goto fail;
+    for (uint32_t i = 0; i < URING_MAX_FILES; i++)
+        u->free_list[i] = URING_MAX_FILES - 1 - i;
+    u->nb_free = URING_MAX_FILES;
+
+    // Opening into a file slot requires Linux 5.15 or later, so make sure it works.
+    // Note that O_CLOEXEC is rejected for files that are opened into a slot.
+    u->probing = true;
+    uring_request* req = &u->requests[u->free_list[--u->nb_free]];
+    strcpy(req->path, ".");
+    queue_file(u, req, (uint32_t)(req - u->requests), O_RDONLY | O_DIRECTORY);
+    if (!uring_wait(u))
+        goto fail;
+    u->probing = false;
+    return u;
+
+fail:
+    uring_destroy(u);
+    return NULL;
+}
+
+bool uring_write_file(uring* u, const char* path, uint8_t* buf, uint32_t size, int64_t* mtime)
+{
+    // Wait for some of the files in flight to be written if we have too many of them
+    while ((u->nb_free == 0) || ((u->pending_bytes != 0) && (u->pending_bytes + size > URING_MAX_BYTES))) {
+        if (!submit(u, 1)) {
+            free(buf);
+            return false;
+        }
+    }
+    uring_request* req = &u->requests[u->free_list[--u->nb_free]];
+    strncpy(req->path, path, sizeof(req->path) - 1);
+    req->path[sizeof(req->path) - 1] = 0;
+    req->buf = buf;
+    req->size = size;
+    req->mtime = mtime;
+    req->failed = false;
+    u->pending_bytes += size;
+    queue_file(u, req, (uint32_t)(req - u->requests), O_WRONLY | O_CREAT | O_TRUNC);
+    if (u->to_submit >= URING_SUBMIT_BATCH)
+        submit(u, 0);
+    else
+        reap_completions(u);
+    return !u->failed;
+}
+
+bool uring_wait(uring* u)
+{
+    while (u->nb_inflight != 0) {
+        if (!submit(u, 1))
+            break;
+    }
+    // Failures are only reported once, so that a ring can be reused for another archive
+    const bool r = !u->failed;
+    u->failed = false;
+    return r;
+}
+
+bool uring_destroy(uring* u)
+{
+    bool r = true;
+    if (u == NULL)
+        return true;
+    if (u->fd >= 0) {
+        r = uring_wait(u);
+        // Closing the ring also closes any file left in its slots
+        close(u->fd);
+    }
+    if (u->sqes != NULL)
+        munmap(u->sqes, u->sqes_size);
+    if ((u->cq_ptr != NULL) && (u->cq_ptr != u->sq_ptr))
+        munmap(u->cq_ptr, u->cq_size);
+    if (u->sq_ptr != NULL)
+        munmap(u->sq_ptr, u->sq_size);
+    for (uint32_t i = 0; i < URING_MAX_FILES; i++)
+        free(u->requests[i].buf);
+    free(u);
+    return r;
+}
+
+#else
+
+uring* uring_create(void)
+{
+    return NULL;
+}
+
+bool uring_write_file(uring* u, const char* path, uint8_t* buf, uint32_t size, int64_t* mtime)
+{
+    (void)u; (void)path; (void)size; (void)mtime;
+    free(buf);
+    return false;
+}
+
+bool uring_wait(uring* u)
+{
+    (void)u;
+    return false;
+}
+
+bool uring_destroy(uring* u)
+{
+    (void)u;
+    return true;
+}
+
+#endif
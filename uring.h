@@ -0,0 +1,41 @@
+/*
+  io_uring file writer for Gust (Koei/Tecmo) PC games tools
+  Copyright © 2019-2020 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#pragma once
+
+// Writes whole files asynchronously, with each file being created, written, closed
+// and stat'ed by a single chain of linked io_uring operations, and many files in
+// flight at once. A ring must only be used by a single thread.
+typedef struct uring uring;
+
+// Returns NULL if io_uring is not available (non Linux platform, old kernel or
+// disabled by the system), in which case regular I/O should be used instead.
+uring* uring_create(void);
+// Queue the creation of path with the size bytes from buf. The ring takes ownership
+// of buf, which must have been allocated with malloc(), and the modification time
+// of the file is stored in mtime once written. Returns false if a file that was
+// previously queued could not be written.
+bool uring_write_file(uring* u, const char* path, uint8_t* buf, uint32_t size, int64_t* mtime);
+// Wait for all the queued files to be written. Returns false if any of the files
+// queued since the previous call failed.
+bool uring_wait(uring* u);
+// Wait for all the queued files to be written and release the ring
+bool uring_destroy(uring* u);
@@ -24,6 +24,126 @@
 #include "utf8.h"
 #include "util.h"
 
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#define XXH_PRIME64_1   0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2   0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3   0x165667B19E3779F9ULL
+#define XXH_PRIME64_4   0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5   0x27D4EB2F165667C5ULL
+#define rotl64(x, r)    (((x) << (r)) | ((x) >> (64 - (r))))
+
+static __inline uint64_t xxh64_round(uint64_t acc, const uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static __inline uint64_t xxh64_merge_round(uint64_t acc, const uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// Process 32-byte stripes. The four independent lanes let the CPU run them in parallel.
+static const uint8_t* xxh64_stripes(uint64_t* v, const uint8_t* p, const uint8_t* end)
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+    for (; p + 32 <= end; p += 32) {
+        v0 = xxh64_round(v0, getle64(p));
+        v1 = xxh64_round(v1, getle64(p + 8));
+        v2 = xxh64_round(v2, getle64(p + 16));
+        v3 = xxh64_round(v3, getle64(p + 24));
+    }
+    v[0] = v0; v[1] = v1; v[2] = v2; v[3] = v3;
+    return p;
+}
+
+void xxh64_init(xxh64_state* state, const uint64_t seed)
+{
+    memset(state, 0, sizeof(xxh64_state));
+    state->seed = seed;
+    state->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = seed + XXH_PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - XXH_PRIME64_1;
+}
+
+void xxh64_update(xxh64_state* state, const void* buf, size_t size)
+{
+    const uint8_t* p = (const uint8_t*)buf;
+    const uint8_t* end = p + size;
+
+    state->total_len += size;
+    if (state->mem_size + size < 32) {
+        if (size != 0)
+            memcpy(&state->mem[state->mem_size], p, size);
+        state->mem_size += (uint32_t)size;
+        return;
+    }
+    if (state->mem_size != 0) {
+        memcpy(&state->mem[state->mem_size], p, 32 - state->mem_size);
+        p += 32 - state->mem_size;
+        xxh64_stripes(state->v, state->mem, &state->mem[32]);
+        state->mem_size = 0;
+    }
+    p = xxh64_stripes(state->v, p, end);
+    if (p < end) {
+        memcpy(state->mem, p, end - p);
+        state->mem_size = (uint32_t)(end - p);
+    }
+}
+
+uint64_t xxh64_digest(const xxh64_state* state)
+{
+    const uint8_t* p = state->mem;
+    const uint8_t* end = p + state->mem_size;
+    uint64_t h;
+
+    if (state->total_len >= 32) {
+        h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) + rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxh64_merge_round(h, state->v[i]);
+    } else {
+        h = state->seed + XXH_PRIME64_5;
+    }
+    h += state->total_len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, getle64(p));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)getle32(p) * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t xxh64(const void* buf, const size_t size, const uint64_t seed)
+{
+    xxh64_state state;
+    xxh64_init(&state, seed);
+    xxh64_update(&state, buf, size);
+    return xxh64_digest(&state);
+}
+
 bool create_path(char* path)
 {
     bool result = true;
@@ -85,6 +205,245 @@ char* change_extension(const char* path, const char* extension)
     return new_path;
 }
 
+// Readahead hints. These are only implemented for POSIX platforms.
+void advise_sequential(FILE* file)
+{
+#if defined(_WIN32)
+    (void)file;
+#else
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+void advise_willneed(FILE* file, const uint64_t offset, const uint64_t size)
+{
+#if defined(_WIN32)
+    (void)file; (void)offset; (void)size;
+#else
+    posix_fadvise(fileno(file), (off_t)offset, (off_t)size, POSIX_FADV_WILLNEED);
+#endif
+}
+
+// Flush the buffered data of file and wait for it to reach the storage device
+bool sync_file(FILE* file)
+{
+    if (fflush(file) != 0)
+        return false;
+#if defined(_WIN32)
+    return (_commit(_fileno(file)) == 0);
+#else
+    return (fsync(fileno(file)) == 0);
+#endif
+}
+
+// Modification time of file, with the finest resolution that the OS reports, in
+// 100 ns units since 1601 on Windows, or in ns since 1970 elsewhere, or 0 on error
+uint64_t file_mtime(FILE* file)
+{
+#if defined(_WIN32)
+    FILETIME ft;
+    if (!GetFileTime((HANDLE)_get_osfhandle(_fileno(file)), NULL, NULL, &ft))
+        return 0;
+    return ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+#else
+    struct stat64 st;
+    if (fstat64(fileno(file), &st) != 0)
+        return 0;
+    return (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + (uint64_t)st.st_mtim.tv_nsec;
+#endif
+}
+
+// Positional read that neither uses nor alters the file position, so that
+// multiple threads can read from the same file concurrently
+bool read_at(FILE* file, void* buf, const size_t size, const uint64_t offset)
+{
+    uint8_t* p = (uint8_t*)buf;
+    size_t done = 0;
+#if defined(_WIN32)
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(file));
+    while (done < size) {
+        DWORD n = 0;
+        OVERLAPPED ov = { 0 };
+        ov.Offset = (DWORD)(offset + done);
+        ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+        if (!ReadFile(h, &p[done], (DWORD)min(size - done, 0x40000000), &n, &ov) || n == 0)
+            return false;
+        done += n;
+    }
+#else
+    while (done < size) {
+        ssize_t n = pread64(fileno(file), &p[done], size - done, (off64_t)(offset + done));
+        if (n <= 0)
+            return false;
+        done += (size_t)n;
+    }
+#endif
+    return true;
+}
+
+bool write_at(FILE* file, const void* buf, const size_t size, const uint64_t offset)
+{
+    const uint8_t* p = (const uint8_t*)buf;
+    size_t done = 0;
+#if defined(_WIN32)
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(file));
+    while (done < size) {
+        DWORD n = 0;
+        OVERLAPPED ov = { 0 };
+        ov.Offset = (DWORD)(offset + done);
+        ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+        if (!WriteFile(h, &p[done], (DWORD)min(size - done, 0x40000000), &n, &ov) || n == 0)
+            return false;
+        done += n;
+    }
+#else
+    while (done < size) {
+        ssize_t n = pwrite64(fileno(file), &p[done], size - done, (off64_t)(offset + done));
+        if (n <= 0)
+            return false;
+        done += (size_t)n;
+    }
+#endif
+    return true;
+}
+
+// Copy a range of data between two files, letting the kernel do it where possible
+bool copy_range(FILE* src, uint64_t src_offset, FILE* dst, uint64_t dst_offset, uint64_t size)
+{
+#if defined(__linux__)
+    loff_t in = (loff_t)src_offset, out = (loff_t)dst_offset;
+    while (size > 0) {
+        ssize_t n = copy_file_range(fileno(src), &in, fileno(dst), &out, (size_t)size, 0);
+        if (n <= 0)
+            break;
+        size -= (uint64_t)n;
+    }
+    // Fall back to a regular copy for whatever the kernel couldn't do
+    src_offset = (uint64_t)in;
+    dst_offset = (uint64_t)out;
+#endif
+    if (size == 0)
+        return true;
+    const size_t buf_size = 1024 * 1024;
+    uint8_t* buf = malloc(buf_size);
+    if (buf == NULL)
+        return false;
+    while (size > 0) {
+        size_t n = (size_t)min(size, buf_size);
+        if (!read_at(src, buf, n, src_offset) || !write_at(dst, buf, n, dst_offset))
+            break;
+        src_offset += n;
+        dst_offset += n;
+        size -= n;
+    }
+    free(buf);
+    return (size == 0);
+}
+
+void* malloc_aligned(const size_t size)
+{
+#if defined(_WIN32)
+    return _aligned_malloc(size, DIRECT_ALIGNMENT);
+#else
+    void* p = NULL;
+    return (posix_memalign(&p, DIRECT_ALIGNMENT, size) == 0) ? p : NULL;
+#endif
+}
+
+void free_aligned(void* p)
+{
+#if defined(_WIN32)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+direct_file open_direct(const char* path, const bool write)
+{
+#if defined(_WIN32)
+    wchar_t* path16 = utf8_to_utf16(path);
+    HANDLE h = CreateFileW(path16, write ? GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+    free(path16);
+    return h;
+#elif defined(O_DIRECT)
+    return open(path, (write ? O_WRONLY : O_RDONLY) | O_DIRECT);
+#else
+    (void)path; (void)write;
+    return NO_DIRECT_FILE;
+#endif
+}
+
+void close_direct(direct_file f)
+{
+    if (f == NO_DIRECT_FILE)
+        return;
+#if defined(_WIN32)
+    CloseHandle(f);
+#else
+    close(f);
+#endif
+}
+
+const uint8_t* read_at_direct(direct_file f, uint8_t* buf, const size_t size, const uint64_t offset)
+{
+    // Read whole blocks, and skip the extra head and tail bytes
+    const uint64_t start = offset & ~((uint64_t)DIRECT_ALIGNMENT - 1);
+    const size_t needed = (size_t)(offset + size - start);
+    const size_t aligned_size = (needed + DIRECT_ALIGNMENT - 1) & ~((size_t)DIRECT_ALIGNMENT - 1);
+    size_t done = 0;
+    // Reads that go past the end of the file come back short
+    while (done < needed) {
+#if defined(_WIN32)
+        DWORD n = 0;
+        OVERLAPPED ov = { 0 };
+        ov.Offset = (DWORD)(start + done);
+        ov.OffsetHigh = (DWORD)((start + done) >> 32);
+        if (!ReadFile(f, &buf[done], (DWORD)(aligned_size - done), &n, &ov) || n == 0)
+            return NULL;
+#else
+        ssize_t n = pread64(f, &buf[done], aligned_size - done, (off64_t)(start + done));
+        if (n <= 0)
+            return NULL;
+#endif
+        done += (size_t)n;
+    }
+    return &buf[offset - start];
+}
+
+bool write_at_direct(FILE* file, direct_file f, const uint8_t* buf, const size_t size, const uint64_t offset)
+{
+    const uint64_t start = (offset + DIRECT_ALIGNMENT - 1) & ~((uint64_t)DIRECT_ALIGNMENT - 1);
+    const uint64_t end = (offset + size) & ~((uint64_t)DIRECT_ALIGNMENT - 1);
+    if (start >= end)
+        return write_at(file, buf, size, offset);
+
+    // The partial blocks at each end go through the OS cache
+    if ((start != offset) && !write_at(file, buf, (size_t)(start - offset), offset))
+        return false;
+    if ((offset + size != end) && !write_at(file, &buf[end - offset], (size_t)(offset + size - end), end))
+        return false;
+    const uint8_t* p = &buf[start - offset];
+    size_t done = 0;
+    while (done < end - start) {
+#if defined(_WIN32)
+        DWORD n = 0;
+        OVERLAPPED ov = { 0 };
+        ov.Offset = (DWORD)(start + done);
+        ov.OffsetHigh = (DWORD)((start + done) >> 32);
+        if (!WriteFile(f, &p[done], (DWORD)min(end - start - done, 0x40000000), &n, &ov) || n == 0)
+            return false;
+#else
+        ssize_t n = pwrite64(f, &p[done], (size_t)(end - start - done), (off64_t)(start + done));
+        if (n <= 0)
+            return false;
+#endif
+        done += (size_t)n;
+    }
+    return true;
+}
+
 uint32_t read_file(const char* path, uint8_t** buf)
 {
     FILE* file = fopen_utf8(path, "rb");
@@ -149,3 +508,148 @@ bool write_file(const uint8_t* buf, const uint32_t size, const char* path, const
         fprintf(stderr, "ERROR: Can't write file '%s'\n", path);
     return r;
 }
+
+// The whole file is mapped at once, so it must fit in the address space
+static __inline bool is_mappable(const uint64_t size)
+{
+#if SIZE_MAX < UINT64_MAX
+    return (size <= SIZE_MAX);
+#else
+    (void)size;
+    return true;
+#endif
+}
+
+void init_mapped_file(mapped_file* m)
+{
+    memset(m, 0, sizeof(mapped_file));
+#if !defined(_WIN32)
+    m->fd = -1;
+#endif
+}
+
+#if defined(_WIN32)
+static bool map_handle(mapped_file* m, const bool writable)
+{
+    if (m->size == 0)
+        return true;
+    m->mapping = CreateFileMappingW(m->handle, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+        (DWORD)(m->size >> 32), (DWORD)m->size, NULL);
+    if (m->mapping == NULL)
+        return false;
+    m->data = MapViewOfFile(m->mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, (SIZE_T)m->size);
+    return (m->data != NULL);
+}
+
+static HANDLE open_handle(const char* path, const bool create)
+{
+    wchar_t* path16 = utf8_to_utf16(path);
+    HANDLE h = CreateFileW(path16, create ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+        FILE_SHARE_READ, NULL, create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    free(path16);
+    return h;
+}
+#endif
+
+bool map_file(const char* path, mapped_file* m)
+{
+    init_mapped_file(m);
+#if defined(_WIN32)
+    LARGE_INTEGER size;
+    m->handle = open_handle(path, false);
+    if (m->handle == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "ERROR: Can't open file '%s'\n", path);
+        return false;
+    }
+    GetFileSizeEx(m->handle, &size);
+    m->size = (uint64_t)size.QuadPart;
+    if (!is_mappable(m->size) || !map_handle(m, false)) {
+#else
+    struct stat64 st;
+    m->fd = open(path, O_RDONLY);
+    if (m->fd < 0) {
+        fprintf(stderr, "ERROR: Can't open file '%s'\n", path);
+        return false;
+    }
+    if ((fstat64(m->fd, &st) != 0) || !is_mappable((uint64_t)st.st_size))
+        m->data = MAP_FAILED;
+    else if (st.st_size != 0)
+        m->data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, m->fd, 0);
+    m->size = (m->data == MAP_FAILED) ? 0 : (uint64_t)st.st_size;
+    if (m->data == MAP_FAILED) {
+        m->data = NULL;
+#endif
+        fprintf(stderr, "ERROR: Can't map file '%s'\n", path);
+        unmap_file(m);
+        return false;
+    }
+    return true;
+}
+
+bool create_mapped_file(const char* path, const uint64_t size, mapped_file* m)
+{
+    init_mapped_file(m);
+    if (!is_mappable(size)) {
+        fprintf(stderr, "ERROR: '%s' is too large to be mapped\n", path);
+        return false;
+    }
+    m->size = size;
+#if defined(_WIN32)
+    LARGE_INTEGER pos;
+    pos.QuadPart = (LONGLONG)size;
+    m->handle = open_handle(path, true);
+    if (m->handle == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
+        return false;
+    }
+    if (!SetFilePointerEx(m->handle, pos, NULL, FILE_BEGIN) || !SetEndOfFile(m->handle) ||
+        !map_handle(m, true)) {
+#else
+    m->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (m->fd < 0) {
+        fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
+        return false;
+    }
+    if (ftruncate64(m->fd, (off64_t)size) == 0 && size != 0)
+        m->data = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    if (m->data == MAP_FAILED || (size != 0 && m->data == NULL)) {
+        m->data = NULL;
+#endif
+        fprintf(stderr, "ERROR: Can't map file '%s'\n", path);
+        unmap_file(m);
+        return false;
+    }
+    return true;
+}
+
+// Let the OS know we are done with a range, so that it doesn't count towards our memory usage
+void release_mapped_range(mapped_file* m, const uint64_t offset, const uint64_t size)
+{
+#if defined(_WIN32)
+    (void)m; (void)offset; (void)size;
+#else
+    const uint64_t page_mask = (uint64_t)sysconf(_SC_PAGESIZE) - 1;
+    uint64_t start = offset & ~page_mask;
+    uint64_t end = min(offset + size, m->size);
+    if (m->data != NULL && end > start)
+        madvise(&m->data[start], (size_t)(end - start), MADV_DONTNEED);
+#endif
+}
+
+void unmap_file(mapped_file* m)
+{
+#if defined(_WIN32)
+    if (m->data != NULL)
+        UnmapViewOfFile(m->data);
+    if (m->mapping != NULL)
+        CloseHandle(m->mapping);
+    if (m->handle != NULL && m->handle != INVALID_HANDLE_VALUE)
+        CloseHandle(m->handle);
+#else
+    if (m->data != NULL)
+        munmap(m->data, (size_t)m->size);
+    if (m->fd >= 0)
+        close(m->fd);
+#endif
+    init_mapped_file(m);
+}
@@ -72,6 +72,13 @@
 #define is_power_of_2(x) (((x) & ((x) - 1)) == 0)
 #endif
 
+// For functions that are meant to be specialized by their constant arguments
+#if defined(_MSC_VER)
+#define force_inline __forceinline
+#else
+#define force_inline __inline __attribute__((always_inline))
+#endif
+
 #if defined(_WIN32)
 static __inline char* _basename(const char* path, bool remove_extension)
 {
@@ -199,12 +206,77 @@ static __inline void setbe64(const void* p, const uint64_t v)
     setle64(p, bswap_uint64(v));
 }
 
+// xxHash64 (https://github.com/Cyan4973/xxHash)
+typedef struct {
+    uint64_t v[4];
+    uint64_t total_len;
+    uint8_t mem[32];
+    uint32_t mem_size;
+    uint64_t seed;
+} xxh64_state;
+
+void xxh64_init(xxh64_state* state, const uint64_t seed);
+void xxh64_update(xxh64_state* state, const void* buf, size_t size);
+uint64_t xxh64_digest(const xxh64_state* state);
+uint64_t xxh64(const void* buf, const size_t size, const uint64_t seed);
+
 bool create_path(char* path);
 char* change_extension(const char* path, const char* extension);
 
 bool is_file(const char* path);
 bool is_directory(const char* path);
 
+typedef struct {
+    uint8_t* data;
+    uint64_t size;
+#if defined(_WIN32)
+    HANDLE handle;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+} mapped_file;
+
+// A mapped_file must be initialized before unmap_file() can be called on it,
+// either by init_mapped_file() or by a call to map_file()/create_mapped_file().
+void init_mapped_file(mapped_file* m);
+bool map_file(const char* path, mapped_file* m);
+bool create_mapped_file(const char* path, const uint64_t size, mapped_file* m);
+void release_mapped_range(mapped_file* m, const uint64_t offset, const uint64_t size);
+void unmap_file(mapped_file* m);
+
+void advise_sequential(FILE* file);
+void advise_willneed(FILE* file, const uint64_t offset, const uint64_t size);
+bool sync_file(FILE* file);
+uint64_t file_mtime(FILE* file);
+bool read_at(FILE* file, void* buf, const size_t size, const uint64_t offset);
+bool write_at(FILE* file, const void* buf, const size_t size, const uint64_t offset);
+bool copy_range(FILE* src, uint64_t src_offset, FILE* dst, uint64_t dst_offset, uint64_t size);
+
+// Direct I/O, that bypasses the OS cache. The offsets, sizes and buffer addresses
+// that are used with a direct_file must be multiples of DIRECT_ALIGNMENT.
+#define DIRECT_ALIGNMENT    4096
+#if defined(_WIN32)
+typedef HANDLE direct_file;
+#define NO_DIRECT_FILE      INVALID_HANDLE_VALUE
+#else
+typedef int direct_file;
+#define NO_DIRECT_FILE      (-1)
+#endif
+void* malloc_aligned(const size_t size);
+void free_aligned(void* p);
+// Open an existing file for direct reads or writes. Returns NO_DIRECT_FILE on error,
+// including if the platform or file system doesn't support direct I/O.
+direct_file open_direct(const char* path, const bool write);
+void close_direct(direct_file f);
+// Read size bytes at offset, which don't need to be aligned, into buf, which must have
+// room for size + 2 * DIRECT_ALIGNMENT bytes. Returns a pointer to the data in buf, or
+// NULL on error.
+const uint8_t* read_at_direct(direct_file f, uint8_t* buf, const size_t size, const uint64_t offset);
+// Write size bytes at offset, with the aligned part of the data written to f and the
+// unaligned head and tail written through file, which must be the same file. Since
+// the aligned part is written from buf as is, buf must be aligned like offset.
+bool write_at_direct(FILE* file, direct_file f, const uint8_t* buf, const size_t size, const uint64_t offset);
 uint32_t read_file(const char* path, uint8_t** buf);
 void create_backup(const char* path);
 bool write_file(const uint8_t* buf, const uint32_t size, const char* path, const bool backup);